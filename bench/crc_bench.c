@@ -0,0 +1,250 @@
+/*
+
+  crc_bench.c - host micro-benchmark of the odometer record CRC
+
+  Compares the bitwise and table driven CRC-16/CCITT and the cost of sealing a record after a typical commit
+  with a full CRC, with the CRC reused up to the first changed chunk and with the CRC of the chunk CRCs used now.
+  The record size and the offsets changed by a commit are those of a 6 axis build with default settings,
+  a commit during motion changes the motor run time and the step counts of three axes.
+
+  Build and run:
+    cc -O2 -o crc_bench crc_bench.c && ./crc_bench
+  The number of commits in thousands may be passed as argument.
+
+  Part of grblHAL
+
+  Copyright (c) 2026 agent
+
+  Grbl is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Grbl is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Grbl.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#define RECORD_SIZE 112
+#define ODOMETER_CRC_CHUNK 32
+#define ODOMETER_CRC_CHUNKS ((RECORD_SIZE + ODOMETER_CRC_CHUNK - 1) / ODOMETER_CRC_CHUNK)
+#define ODOMETER_CRC_CHUNK_SIZE(offset) (RECORD_SIZE - (offset) < ODOMETER_CRC_CHUNK ? RECORD_SIZE - (offset) : ODOMETER_CRC_CHUNK)
+
+static const uint16_t hot[] = { 8, 76, 80, 84 }; // Offsets of motors and the current step counts of the X, Y and Z axes.
+
+static uint16_t crc16_table[256];
+
+static uint16_t crc16_bitwise (uint16_t crc, const void *data, uint32_t size)
+{
+    uint_fast8_t bit;
+    const uint8_t *byte = data;
+
+    while(size--) {
+        crc ^= (uint16_t)*byte++ << 8;
+        for(bit = 0; bit < 8; bit++)
+            crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+
+    return crc;
+}
+
+static uint16_t crc16 (uint16_t crc, const void *data, uint32_t size)
+{
+    const uint8_t *byte = data;
+
+    while(size--)
+        crc = (crc << 8) ^ crc16_table[(crc >> 8) ^ *byte++];
+
+    return crc;
+}
+
+static void crc16_init (void)
+{
+    uint_fast16_t idx;
+    uint8_t byte;
+
+    for(idx = 0; idx < 256; idx++) {
+        byte = (uint8_t)idx;
+        crc16_table[idx] = crc16_bitwise(0, &byte, 1);
+    }
+}
+
+// Full CRC of the record.
+static uint16_t seal_full (uint8_t *record, const uint8_t *data)
+{
+    memcpy(record, data, RECORD_SIZE);
+
+    return crc16(0xFFFF, record, RECORD_SIZE);
+}
+
+// CRC after each chunk is cached, the CRC is calculated from the first chunk that has changed.
+static uint16_t seal_prefix (uint8_t *record, const uint8_t *data, uint16_t *cache)
+{
+    uint16_t crc = 0xFFFF;
+    uint_fast16_t chunk = 0, offset = 0, size;
+
+    while(offset < RECORD_SIZE && !memcmp(record + offset, data + offset, (size = ODOMETER_CRC_CHUNK_SIZE(offset)))) {
+        offset += size;
+        chunk++;
+    }
+    if(chunk)
+        crc = cache[chunk - 1];
+
+    memcpy(record + offset, data + offset, RECORD_SIZE - offset);
+
+    while(offset < RECORD_SIZE) {
+        size = ODOMETER_CRC_CHUNK_SIZE(offset);
+        crc = cache[chunk++] = crc16(crc, record + offset, size);
+        offset += size;
+    }
+
+    return crc;
+}
+
+// CRC of each chunk is cached, only chunks that has changed are calculated and the CRC of the chunk CRCs is returned.
+static uint16_t seal_chunks (uint8_t *record, const uint8_t *data, uint16_t *cache)
+{
+    uint_fast16_t chunk = 0, offset = 0, size;
+
+    while(offset < RECORD_SIZE) {
+        size = ODOMETER_CRC_CHUNK_SIZE(offset);
+        if(memcmp(record + offset, data + offset, size)) {
+            memcpy(record + offset, data + offset, size);
+            cache[chunk] = crc16(0xFFFF, record + offset, size);
+        }
+        offset += size;
+        chunk++;
+    }
+
+    return crc16(0xFFFF, cache, ODOMETER_CRC_CHUNKS * sizeof(uint16_t));
+}
+
+static double elapsed_ns (struct timespec *t0)
+{
+    struct timespec t1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    return (t1.tv_sec - t0->tv_sec) * 1e9 + (t1.tv_nsec - t0->tv_nsec);
+}
+
+static inline void commit (uint8_t *data)
+{
+    uint32_t value;
+    uint_fast8_t idx;
+
+    for(idx = 0; idx < sizeof(hot) / sizeof(hot[0]); idx++) {
+        memcpy(&value, data + hot[idx], sizeof(uint32_t));
+        value++;
+        memcpy(data + hot[idx], &value, sizeof(uint32_t));
+    }
+}
+
+int main (int argc, char **argv)
+{
+    static uint8_t data[RECORD_SIZE], full[RECORD_SIZE], prefix[RECORD_SIZE], chunks[RECORD_SIZE];
+
+    uint16_t prefix_cache[ODOMETER_CRC_CHUNKS], chunk_cache[ODOMETER_CRC_CHUNKS], check = 0;
+    uint32_t i, commits = (argc > 1 ? (uint32_t)atoi(argv[1]) : 1000) * 1000UL, bytes = 64 * 1024 * 1024;
+    struct timespec t0;
+    double ns;
+
+    if(commits == 0)
+        return 1;
+
+    crc16_init();
+
+    if(crc16(0xFFFF, "123456789", 9) != 0x29B1 || crc16_bitwise(0xFFFF, "123456789", 9) != 0x29B1) {
+        printf("FAIL: CRC check value\n");
+        return 1;
+    }
+
+    srand(1);
+    for(i = 0; i < RECORD_SIZE; i++)
+        data[i] = (uint8_t)rand();
+
+    // Throughput
+    {
+        static uint8_t buf[4096];
+
+        memcpy(buf, data, RECORD_SIZE);
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for(i = 0; i < bytes / sizeof(buf); i++) {
+            buf[0] = (uint8_t)i;
+            check ^= crc16_bitwise(0xFFFF, buf, sizeof(buf));
+        }
+        ns = elapsed_ns(&t0);
+        printf("bitwise: %6.1f bytes/us\n", bytes / ns * 1000.0);
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for(i = 0; i < bytes / sizeof(buf); i++) {
+            buf[0] = (uint8_t)i;
+            check ^= crc16(0xFFFF, buf, sizeof(buf));
+        }
+        ns = elapsed_ns(&t0);
+        printf("table:   %6.1f bytes/us\n", bytes / ns * 1000.0);
+    }
+
+    // Sealing after a commit, the caches are primed with the initial data.
+    seal_full(full, data);
+    memset(prefix, 0, RECORD_SIZE);
+    seal_prefix(prefix, data, prefix_cache);
+    memcpy(chunks, data, RECORD_SIZE);
+    for(i = 0; i < ODOMETER_CRC_CHUNKS; i++)
+        chunk_cache[i] = crc16(0xFFFF, chunks + i * ODOMETER_CRC_CHUNK, ODOMETER_CRC_CHUNK_SIZE(i * ODOMETER_CRC_CHUNK));
+
+    printf("%d byte record, %d byte chunks, %lu commits\n", RECORD_SIZE, ODOMETER_CRC_CHUNK, (unsigned long)commits);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for(i = 0; i < commits; i++) {
+        commit(data);
+        check ^= seal_full(full, data);
+    }
+    ns = elapsed_ns(&t0);
+    printf("full:    %6.1f ns/commit\n", ns / commits);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for(i = 0; i < commits; i++) {
+        commit(data);
+        check ^= seal_prefix(prefix, data, prefix_cache);
+    }
+    ns = elapsed_ns(&t0);
+    printf("prefix:  %6.1f ns/commit\n", ns / commits);
+
+    if(seal_full(full, data) != seal_prefix(prefix, data, prefix_cache)) {
+        printf("FAIL: prefix CRC differs from full CRC\n");
+        return 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for(i = 0; i < commits; i++) {
+        commit(data);
+        check ^= seal_chunks(chunks, data, chunk_cache);
+    }
+    ns = elapsed_ns(&t0);
+    printf("chunks:  %6.1f ns/commit\n", ns / commits);
+
+    for(i = 0; i < ODOMETER_CRC_CHUNKS; i++) {
+        if(chunk_cache[i] != crc16(0xFFFF, data + i * ODOMETER_CRC_CHUNK, ODOMETER_CRC_CHUNK_SIZE(i * ODOMETER_CRC_CHUNK))) {
+            printf("FAIL: chunk CRC differs\n");
+            return 1;
+        }
+    }
+
+    printf("check:   %04X\n", check); // Keeps the results used.
+
+    return 0;
+}
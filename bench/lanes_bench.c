@@ -0,0 +1,202 @@
+/*
+
+  lanes_bench.c - host micro-benchmark of the per step pulse odometer accumulator
+
+  Compares the per axis test and increment used up to v0.06 with the packed lanes used now,
+  over the same sequence of random step masks, and checks that both count the same steps.
+
+  Build and run:
+    cc -O2 -DN_AXIS=3 -o lanes_bench lanes_bench.c && ./lanes_bench
+  N_AXIS may be set from 3 to 8, the number of pulses in millions may be passed as argument.
+
+  Part of grblHAL
+
+  Copyright (c) 2026 agent
+
+  Grbl is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Grbl is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Grbl.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#ifndef N_AXIS
+#define N_AXIS 3
+#endif
+
+#if N_AXIS < 3 || N_AXIS > 8
+#error "N_AXIS must be in the range 3 - 8"
+#endif
+
+#define AXES_BITMASK ((1 << N_AXIS) - 1)
+#define ODOMETER_LANE_BITS (64 / N_AXIS)
+#define ODOMETER_LANE_MAX ((1UL << ODOMETER_LANE_BITS) - 1)
+#define MASKS 4096 // Power of 2
+
+typedef union {
+    uint8_t mask;
+    struct {
+        uint8_t x :1,
+                y :1,
+                z :1,
+                a :1,
+                b :1,
+                c :1,
+                u :1,
+                v :1;
+    };
+} axes_signals_t;
+
+typedef struct {
+    axes_signals_t step_outbits;
+} stepper_t;
+
+typedef void (*stepper_pulse_start_ptr)(stepper_t *stepper);
+
+static volatile uint32_t steps[N_AXIS];
+static uint64_t lanes = 0, lane_step[1 << N_AXIS];
+static volatile uint32_t lane_pulses = 0;
+
+// Called through a pointer as the plugin is called from the driver.
+static volatile stepper_pulse_start_ptr pulse_start;
+
+__attribute__((noinline)) static void branchPulseStart (stepper_t *stepper)
+{
+    if(stepper->step_outbits.x)
+        steps[0]++;
+    if(stepper->step_outbits.y)
+        steps[1]++;
+    if(stepper->step_outbits.z)
+        steps[2]++;
+#if N_AXIS > 3
+    if(stepper->step_outbits.a)
+        steps[3]++;
+#endif
+#if N_AXIS > 4
+    if(stepper->step_outbits.b)
+        steps[4]++;
+#endif
+#if N_AXIS > 5
+    if(stepper->step_outbits.c)
+        steps[5]++;
+#endif
+#if N_AXIS > 6
+    if(stepper->step_outbits.u)
+        steps[6]++;
+#endif
+#if N_AXIS > 7
+    if(stepper->step_outbits.v)
+        steps[7]++;
+#endif
+}
+
+__attribute__((noinline)) static void lanes_drain (void)
+{
+    uint64_t acc = lanes;
+    uint_fast8_t idx = N_AXIS;
+
+    lanes = 0;
+    lane_pulses = 0;
+
+    do {
+        idx--;
+        steps[idx] += (uint32_t)(acc >> (idx * ODOMETER_LANE_BITS)) & ODOMETER_LANE_MAX;
+    } while(idx);
+}
+
+__attribute__((noinline)) static void lanesPulseStart (stepper_t *stepper)
+{
+    lanes += lane_step[stepper->step_outbits.mask & AXES_BITMASK];
+
+    if(++lane_pulses == ODOMETER_LANE_MAX)
+        lanes_drain();
+}
+
+static void lanes_init (void)
+{
+    uint_fast8_t idx;
+    uint_fast16_t mask = 1 << N_AXIS;
+
+    do {
+        lane_step[--mask] = 0;
+        for(idx = 0; idx < N_AXIS; idx++) {
+            if(mask & (1 << idx))
+                lane_step[mask] |= 1ULL << (idx * ODOMETER_LANE_BITS);
+        }
+    } while(mask);
+}
+
+static double run (stepper_pulse_start_ptr fn, stepper_t *stepper, uint32_t pulses, uint64_t *total)
+{
+    uint32_t i;
+    struct timespec t0, t1;
+    uint_fast8_t idx;
+
+    for(idx = 0; idx < N_AXIS; idx++)
+        steps[idx] = 0;
+
+    pulse_start = fn;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for(i = 0; i < pulses; i++)
+        pulse_start(&stepper[i & (MASKS - 1)]);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    if(lane_pulses)
+        lanes_drain();
+
+    for(*total = 0, idx = 0; idx < N_AXIS; idx++)
+        *total += steps[idx];
+
+    return ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / pulses;
+}
+
+int main (int argc, char **argv)
+{
+    static stepper_t stepper[MASKS];
+
+    uint32_t i, pulses = (argc > 1 ? (uint32_t)atoi(argv[1]) : 100) * 1000000UL;
+    uint64_t branch_total, lanes_total;
+    double branch_ns, lanes_ns;
+
+    if(pulses == 0)
+        return 1;
+
+    lanes_init();
+
+    // Random step masks with at least one axis stepping.
+    srand(1);
+    for(i = 0; i < MASKS; i++) {
+        while((stepper[i].step_outbits.mask = rand() & AXES_BITMASK) == 0);
+    }
+
+    run(branchPulseStart, stepper, pulses / 10 + 1, &branch_total); // Warm up
+
+    branch_ns = run(branchPulseStart, stepper, pulses, &branch_total);
+    lanes_ns = run(lanesPulseStart, stepper, pulses, &lanes_total);
+
+    printf("N_AXIS %d, %lu pulses\n", N_AXIS, (unsigned long)pulses);
+    printf("branch: %6.2f ns/pulse, %llu steps\n", branch_ns, (unsigned long long)branch_total);
+    printf("lanes:  %6.2f ns/pulse, %llu steps\n", lanes_ns, (unsigned long long)lanes_total);
+
+    if(branch_total != lanes_total) {
+        printf("FAIL: step totals differ\n");
+        return 1;
+    }
+
+    return 0;
+}
@@ -31,6 +31,7 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <stddef.h>
 
 #ifdef ARDUINO
 #include "../grbl/system.h"
@@ -42,112 +43,915 @@
 #include "grbl/nvs_buffer.h"
 #endif
 
+#include "odometer_storage.h"
+
+#ifndef ODOMETER_COUNT_SEGMENTS
+#define ODOMETER_COUNT_SEGMENTS 0   // Set to 1 to count steps per segment from the machine position
+#endif                              // instead of per step pulse, no per pulse hook is installed.
+
+#ifndef ODOMETER_FOLD_INTERVAL
+#define ODOMETER_FOLD_INTERVAL 1000 // ms, must be well below the time needed to output 2^32 steps on any axis.
+#endif
+
+#ifndef ODOMETER_CHECKPOINT_INTERVAL
+#define ODOMETER_CHECKPOINT_INTERVAL 300 // s, set to 0 to only write odometer data when motion stops.
+#endif
+
+#ifndef ODOMETER_COMMIT_DELAY
+#define ODOMETER_COMMIT_DELAY 5000  // ms, quiet period required after motion stops before odometer data is written.
+#endif
+
+#ifndef ODOMETER_EEPROM_ENDURANCE
+#define ODOMETER_EEPROM_ENDURANCE 1000000.0f    // Rated write cycles per cell.
+#endif
+
+#ifndef ODOMETER_FRAM_ENDURANCE
+#define ODOMETER_FRAM_ENDURANCE 100000000000000.0f
+#endif
+
+#ifndef ODOMETER_NVS_LIFE
+#define ODOMETER_NVS_LIFE 10        // years, target service life of the NVS part used for the checkpoint interval.
+#endif
+
+#ifndef ODOMETER_SPINDLE_POWER
+#define ODOMETER_SPINDLE_POWER 0    // W, rated spindle power at max rpm used for the energy estimate, 0 to disable.
+#endif
+
+#ifndef ODOMETER_ENCODER_INTERVAL
+#define ODOMETER_ENCODER_INTERVAL 1000 // ms, spindle encoder sample interval.
+#endif
+
+#ifndef ODOMETER_ENCODER_SETTLE
+#define ODOMETER_ENCODER_SETTLE 5000 // ms, time allowed for the spindle to reach a new commanded rpm before the deviation is sampled.
+#endif
+
+#ifndef ODOMETER_FILE_SIZE
+#define ODOMETER_FILE_SIZE 4096     // bytes, size of file used for odometer data when ODOMETER_FILE is defined as its path.
+#endif
+
+#define ODOMETER_LANE_BITS (64 / N_AXIS)
+#define ODOMETER_LANE_MAX ((1UL << ODOMETER_LANE_BITS) - 1)
+
+// Data format used up to v0.06, migrated on first startup.
 typedef struct {
     uint64_t motors;
     uint64_t spindle;
     float distance[N_AXIS];
-} odometer_data_t;
-
-static uint32_t steps[N_AXIS] = {0};
-static bool odometer_changed = false;
-static uint32_t odometers_address, odometers_address_prv;
+} odometer_data_v006_t;
+
+static volatile uint32_t steps[N_AXIS] = {0}; // Written by the stepper interrupt only, wraps around.
+static uint32_t steps_folded[N_AXIS] = {0};
+static uint64_t steps_pending[N_AXIS] = {0};
+static float steps_per_mm[N_AXIS] = {0}; // steps/mm in effect for the pending steps.
+static bool odometer_changed = false, checkpointed = false;
+static bool commit_pending = false, committed = false, motion = false;
+static volatile bool reset_pending = false;
+static uint32_t motors_ms = 0, checkpoint_ms = 0, commit_ms = 0, committed_ms = 0;
+static uint32_t motors_carry = 0, spindle_carry = 0; // ms not yet added to the run times.
+static volatile uint32_t spindles_on = 0; // Bit per spindle id.
+// Run intervals closed by the spindle state hook, not yet accounted for by the foreground process.
+typedef struct {
+    uint32_t ms;
+    uint32_t starts;
+    float revolutions;
+    float load;                     // s
+#if ODOMETER_RPM_BINS
+    uint32_t bin_ms[ODOMETER_RPM_BINS];
+#endif
+} spindle_pending_t;
+// Per log entry, the last entry is shared by spindles without a log entry and only adds to the total run time.
+static struct {
+    spindle_pending_t pending;      // Written by the spindle state hook, may be called from interrupt context.
+    uint32_t carry;
+    float revolutions;              // Not yet logged.
+    float load;                     // s, not yet logged.
+#if ODOMETER_RPM_BINS
+    float bin_scale;                // Bins per rpm.
+    int32_t bin_ms[ODOMETER_RPM_BINS]; // Not yet logged, negative when rounded up.
+#endif
+} spindle_account[ODOMETER_SPINDLES + 1] = {0};
+// Per spindle id.
+static struct {
+    bool on;
+    uint8_t entry;                  // Log entry, ODOMETER_SPINDLES if none and ODOMETER_SPINDLE_FREE until first started.
+    uint32_t ms;                    // Start of the open run interval.
+    float rpm;                      // Commanded rpm since ms.
+    float rpm_max;                  // Max rpm of the spindle since ms.
+#if ODOMETER_RPM_BINS
+    uint_fast8_t bin;               // Histogram bin of the commanded rpm.
+#endif
+#if ODOMETER_SPINDLE_ENCODER
+    uint32_t rpm_ms;                // Time of last rpm change or start.
+#endif
+    spindle_set_state_ptr set_state; // Original entry point, kept per spindle since switching spindles changes it.
+} spindle_run[N_SPINDLE] = {0};
+#if ODOMETER_SPINDLE_ENCODER
+// Only the selected spindle is sampled, spindles may share the encoder.
+static struct {
+    uint_fast8_t id;
+    bool sampled;                   // Counters below are valid.
+    bool counting;                  // Counters has been seen nonzero, spindles without an encoder, e.g. VFDs, reports the rpm only.
+    uint32_t ms;
+    uint32_t index_count;
+    uint32_t pulse_count;
+    uint32_t revolutions;           // Not yet logged.
+    uint32_t samples;               // Deviation samples in the current run.
+    float deviation_sum;
+    float deviation_max;
+    spindle_get_data_ptr get_data;
+} encoder = {0};
+#endif
+static volatile uint32_t reset_ms;
+static uint32_t checkpoint_interval = ODOMETER_CHECKPOINT_INTERVAL * 1000; // ms, may be increased by the write budget governor.
+static uint32_t commit_interval = 0; // ms, minimum time between commits requested when motion stops, set by the write budget governor.
+static float nvs_endurance, nvs_life = 0.0f;
+static volatile bool storage_busy = false; // Background write in progress.
+static bool storage_locked = false; // NVS space used is claimed by the driver or a plugin, no writes are made.
+static uint32_t storage_ms = 0, recovery_us = 0;
+static const odometer_storage_t *storage = NULL;
+static const odometer_flash_t *flash = NULL;
 static odometer_data_t odometers, odometers_prv;
+#if ODOMETER_POWER_FAIL
+static bool image_stale = true;     // Power fail image needs to be prepared again.
+#endif
 static nvs_io_t nvs;
+#if ODOMETER_COUNT_SEGMENTS
+static bool position_resync = true; // Position is synchronized on the next segment loaded, set when the steppers go idle.
+static int32_t position[N_AXIS];
+static stepper_cycles_per_tick_ptr stepper_cycles_per_tick;
+#else
+static uint64_t lanes = 0, lane_step[1 << N_AXIS];
+static volatile uint32_t lane_pulses = 0;
 static stepper_pulse_start_ptr stepper_pulse_start;
+#endif
+static stepper_go_idle_ptr stepper_go_idle;
 static on_state_change_ptr on_state_change;
+static on_execute_realtime_ptr on_execute_realtime;
 static on_spindle_selected_ptr on_spindle_selected;
-static spindle_set_state_ptr spindle_set_state_;
 static settings_changed_ptr settings_changed;
 static on_report_options_ptr on_report_options;
+static on_reset_ptr on_reset;
 
-static void stepperPulseStart (stepper_t *stepper)
+#if ODOMETER_COUNT_SEGMENTS
+
+// Direction changes only occur at block boundaries, and thus at segment boundaries.
+// The absolute change of the machine position since the previous segment is then the
+// number of steps output for each axis during that segment.
+// NOTE: steps output by backlash compensation does not update the machine position and is not counted.
+ISR_CODE static void ISR_FUNC(position_fold)(void)
 {
-    odometer_changed = true;
+    int32_t delta;
+    uint_fast8_t idx = N_AXIS;
+
+    do {
+        idx--;
+        if((delta = sys.position[idx] - position[idx])) {
+            steps[idx] += delta < 0 ? -delta : delta;
+            position[idx] = sys.position[idx];
+        }
+    } while(idx);
+}
 
-    if(stepper->step_outbits.x)
-        steps[X_AXIS]++;
+static inline void position_sync (void)
+{
+    memcpy(position, sys.position, sizeof(position));
+}
 
-    if(stepper->step_outbits.y)
-        steps[Y_AXIS]++;
+// Called by the stepper interrupt handler once per segment loaded.
+// The machine position may be changed while the steppers are idle, e.g. homing sets it at the start
+// of each approach, pull-off and locate phase and on completion. The first segment loaded after idle
+// then resynchronizes instead of counting the change.
+ISR_CODE static void ISR_FUNC(stepperCyclesPerTick)(uint32_t cycles_per_tick)
+{
+    if(position_resync) {
+        position_resync = false;
+        position_sync();
+    } else
+        position_fold();
 
-    if(stepper->step_outbits.z)
-        steps[Z_AXIS]++;
+    stepper_cycles_per_tick(cycles_per_tick);
+}
+
+// Called when the last segment has been executed or motion is aborted, may be called again while idle.
+ISR_CODE static void ISR_FUNC(stepperGoIdle)(bool clear_signals)
+{
+    stepper_go_idle(clear_signals);
+
+    if(!position_resync) {
+        position_fold();
+        position_resync = true;
+    }
+}
 
-#ifdef A_AXIS
-    if(stepper->step_outbits.a)
-        steps[A_AXIS]++;
+#else
+
+// Steps are accumulated in N_AXIS bit fields packed into a 64-bit word, one lookup and one add per pulse.
+// The packed counters are drained to steps[] before any of the fields can overflow, when the steppers go idle
+// and on the pulse following a drain request from the foreground, see steps_fold().
+ISR_CODE static void ISR_FUNC(lanes_drain)(void)
+{
+    uint64_t acc = lanes;
+    uint_fast8_t idx = N_AXIS;
+
+    lanes = 0;
+    lane_pulses = 0;
+
+    do {
+        idx--;
+        steps[idx] += (uint32_t)(acc >> (idx * ODOMETER_LANE_BITS)) & ODOMETER_LANE_MAX;
+    } while(idx);
+}
+
+ISR_CODE static void ISR_FUNC(stepperPulseStart)(stepper_t *stepper)
+{
+    lanes += lane_step[stepper->step_outbits.mask & AXES_BITMASK];
+
+    if(++lane_pulses == ODOMETER_LANE_MAX)
+        lanes_drain();
+
+    stepper_pulse_start(stepper);
+}
+
+ISR_CODE static void ISR_FUNC(stepperGoIdle)(bool clear_signals)
+{
+    stepper_go_idle(clear_signals);
+
+    if(lane_pulses)
+        lanes_drain();
+}
+
+static void lanes_init (void)
+{
+    uint_fast8_t idx;
+    uint_fast16_t mask = 1 << N_AXIS;
+
+    do {
+        lane_step[--mask] = 0;
+        for(idx = 0; idx < N_AXIS; idx++) {
+            if(mask & (1 << idx))
+                lane_step[mask] |= 1ULL << (idx * ODOMETER_LANE_BITS);
+        }
+    } while(mask);
+}
+
+#endif // ODOMETER_COUNT_SEGMENTS
+
+// For storage rotating commits over a number of slots each cell is written at most once per commit,
+// the number of commits left before the rated endurance is reached is then the endurance times
+// the number of slots minus the commits made so far (the sequence number).
+// The checkpoint interval is increased when needed to spread the remaining commits over the
+// remaining target life, assuming continuous motion. Commits requested when motion stops are delayed until
+// the same interval has passed since the previous commit, but only when a larger part of the endurance than
+// of the target life has been used and the interval is longer than the idle delay.
+// There is no calendar clock, the motor run time is used as the elapsed life. This overestimates
+// the remaining life and thus the interval, the target life is then still reached.
+static void governor_update (void)
+{
+    if(!storage->cap.rotating)
+        return;
+
+    float commits = nvs_endurance * (float)storage->status->slots - (float)storage->status->seq,
+          life = (float)ODOMETER_NVS_LIFE * 31557600.0f - (float)odometers.motors;
+
+    if(commits < 1.0f)
+        commits = 1.0f;
+
+    if(life < 0.0f)
+        life = 0.0f;
+
+    checkpoint_interval = ODOMETER_CHECKPOINT_INTERVAL * 1000;
+
+    if(checkpoint_interval && life / commits > (float)ODOMETER_CHECKPOINT_INTERVAL)
+        checkpoint_interval = life / commits >= 86400.0f ? 86400000 : (uint32_t)(life / commits * 1000.0f);
+
+    if((float)storage->status->seq <= nvs_endurance * (float)storage->status->slots * (float)odometers.motors / ((float)ODOMETER_NVS_LIFE * 31557600.0f))
+        commit_interval = 0;
+    else {
+        commit_interval = life / commits >= 86400.0f ? 86400000 : (uint32_t)(life / commits * 1000.0f);
+        if(commit_interval <= ODOMETER_COMMIT_DELAY)
+            commit_interval = 0;
+    }
+
+    // Estimated remaining life in years with continuous motion and the current checkpoint interval.
+    nvs_life = commits * (float)(checkpoint_interval ? checkpoint_interval : ODOMETER_COMMIT_DELAY) / 1000.0f / 31557600.0f;
+    if(nvs_life > 999.0f)
+        nvs_life = 999.0f;
+}
+
+// Write odometer data to NVS, for background capable storage the write is completed by the foreground process.
+static void odometers_commit (void)
+{
+    commit_pending = false;
+    committed = true;
+    committed_ms = hal.get_elapsed_ticks();
+#if ODOMETER_POWER_FAIL
+    image_stale = true;
 #endif
 
-#ifdef B_AXIS
-    if(stepper->step_outbits.b)
-        steps[B_AXIS]++;
+    if(storage_locked)
+        return;
+
+    storage->write(&odometers);
+
+    if(!(storage_busy = storage->cap.background))
+        governor_update();
+}
+
+// Write odometer data to NVS when the machine has been idle for ODOMETER_COMMIT_DELAY milliseconds,
+// requests made before that are merged into a single write.
+static void odometers_commit_request (void)
+{
+    commit_pending = true;
+#if ODOMETER_POWER_FAIL
+    image_stale = true;
 #endif
+    commit_ms = hal.get_elapsed_ticks();
+}
 
-#ifdef C_AXIS
-    if(stepper->step_outbits.c)
-        steps[C_AXIS]++;
+static inline uint64_t steps_get (odometer_data_t *odometers, uint_fast8_t idx, uint_fast8_t entry)
+{
+    return (uint64_t)odometers->steps_hi[idx][entry] << 32 | odometers->steps[idx][entry];
+}
+
+static inline void steps_set (odometer_data_t *odometers, uint_fast8_t idx, uint_fast8_t entry, uint64_t steps)
+{
+    odometers->steps[idx][entry] = (uint32_t)steps;
+    odometers->steps_hi[idx][entry] = (uint16_t)(steps >> 32);
+}
+
+// Add elapsed time to a run time in seconds, the remainder is carried to the next call.
+static inline void time_add (uint32_t *seconds, uint32_t *carry, uint32_t ms)
+{
+    ms += *carry;
+    *seconds += ms / 1000;
+    *carry = ms % 1000;
+}
+
+static void odometer_data_clear (odometer_data_t *odometers)
+{
+    memset(odometers, 0, sizeof(odometer_data_t));
+
+    odometers->version = ODOMETER_DATA_VERSION;
+    odometers->axes = N_AXIS;
+    odometers->history = ODOMETER_SCALE_HISTORY;
+    odometers->spindles = ODOMETER_SPINDLES;
+    odometers->bins = ODOMETER_RPM_BINS;
+    odometers->blocks = ODOMETER_BLOCKS;
+    memset(odometers->spindle_id, ODOMETER_SPINDLE_FREE, sizeof(odometers->spindle_id));
+}
+
+// Data with a layout other than the current is imported by odometers_import(), the record size check normally catches this.
+static inline bool odometer_data_valid (odometer_data_t *odometers)
+{
+    return odometers->version == ODOMETER_DATA_VERSION && odometers->axes == N_AXIS && odometers->history == ODOMETER_SCALE_HISTORY &&
+            odometers->spindles == ODOMETER_SPINDLES && odometers->bins == ODOMETER_RPM_BINS && odometers->blocks == ODOMETER_BLOCKS;
+}
+
+// Fold steps output since the last call into the 64-bit pending counts.
+// steps[] is never reset so it can be read here without locking out the stepper interrupt,
+// a step output while folding is picked up by the next call.
+static void steps_fold (void)
+{
+    uint32_t count;
+    uint_fast8_t idx = N_AXIS;
+
+#if !ODOMETER_COUNT_SEGMENTS
+    // Request a drain of the packed counters on the next step pulse, the steps drained are picked up by the next call.
+    // A drain by the stepper interrupt between the test and the assignment just brings the next drain forward.
+    if(lane_pulses)
+        lane_pulses = ODOMETER_LANE_MAX - 1;
 #endif
 
-    stepper_pulse_start(stepper);
+    do {
+        idx--;
+        if((count = steps[idx] - steps_folded[idx])) {
+            steps_folded[idx] += count;
+            steps_pending[idx] += count;
+            odometer_changed = true;
+        }
+    } while(idx);
 }
 
-void onStateChanged (sys_state_t state)
+// Add pending steps to the current steps/mm entry of the odometers.
+static void steps_flush (void)
 {
-    static uint32_t ms = 0;
+    uint_fast8_t idx = N_AXIS;
 
-    if(state & (STATE_CYCLE|STATE_JOG|STATE_HOMING|STATE_SAFETY_DOOR))
-        ms = hal.get_elapsed_ticks();
+    odometer_changed = false;
 
-    else if(odometer_changed) {
+    do {
+        if(steps_pending[--idx]) {
+            if(steps_get(&odometers, idx, 0) == 0)
+                odometers.steps_per_mm[idx][0] = steps_per_mm[idx];
+            steps_set(&odometers, idx, 0, steps_get(&odometers, idx, 0) + steps_pending[idx]);
+            steps_pending[idx] = 0;
+        }
+    } while(idx);
+}
 
-        uint_fast8_t idx = N_AXIS;
+// Start a new steps/mm entry for the axis, the two oldest entries are merged when the history is full.
+// Merging converts the oldest step count to the steps/mm of the next entry, rounding to the nearest step.
+// Without a history the step count is converted to the new steps/mm.
+static void scale_push (uint_fast8_t idx, float new_steps_per_mm)
+{
+#if ODOMETER_SCALE_HISTORY == 1
+    steps_set(&odometers, idx, 0, (uint64_t)((double)steps_get(&odometers, idx, 0) * new_steps_per_mm / odometers.steps_per_mm[idx][0] + 0.5));
+    odometers.steps_per_mm[idx][0] = new_steps_per_mm;
+#else
+    uint_fast8_t entry = ODOMETER_SCALE_HISTORY - 1;
+
+    if(steps_get(&odometers, idx, entry)) {
+        steps_set(&odometers, idx, entry - 1, steps_get(&odometers, idx, entry - 1) +
+                   (uint64_t)((double)steps_get(&odometers, idx, entry) * odometers.steps_per_mm[idx][entry - 1] / odometers.steps_per_mm[idx][entry] + 0.5));
+    }
+
+    do {
+        steps_set(&odometers, idx, entry, steps_get(&odometers, idx, entry - 1));
+        odometers.steps_per_mm[idx][entry] = odometers.steps_per_mm[idx][entry - 1];
+    } while(--entry);
 
-        odometer_changed = false;
-        odometers.motors += (hal.get_elapsed_ticks() - ms);
+    steps_set(&odometers, idx, 0, 0);
+    odometers.steps_per_mm[idx][0] = new_steps_per_mm;
+#endif
+}
+
+static float odometer_distance (odometer_data_t *odometers, uint_fast8_t idx)
+{
+    float distance = 0.0f;
+    uint_fast8_t entry = ODOMETER_SCALE_HISTORY;
+
+    do {
+        if(steps_get(odometers, idx, --entry))
+            distance += (float)steps_get(odometers, idx, entry) / odometers->steps_per_mm[idx][entry];
+    } while(entry);
+
+    return distance;
+}
+
+#if ODOMETER_RPM_BINS
+
+#define ODOMETER_RPM_SCALE_MAX 20    // 2^20 s units, the max that fits the not yet logged ms.
+#define ODOMETER_RPM_CHUNK_MAX 0x20000000UL // ms, max added at once, about 6 days.
+
+static inline uint_fast8_t spindle_bin (uint_fast8_t id, float rpm)
+{
+    uint_fast16_t bin = (uint_fast16_t)(rpm * spindle_account[spindle_run[id].entry].bin_scale);
+
+    return bin < ODOMETER_RPM_BINS ? bin : ODOMETER_RPM_BINS - 1;
+}
 
-        do {
-            if(steps[--idx]) {
-                odometers.distance[idx] += (float)steps[idx] / settings.axis[idx].steps_per_mm;
-                steps[idx] = 0;
+// Time is logged rounded to the nearest unit, the time not yet logged is kept in RAM and lost on power down.
+// Rounding keeps the loss within half a unit either way per power cycle instead of up to a unit lost.
+// When a bin would overflow the histogram scale is increased, the unit dropped from odd bins is kept as not yet logged time.
+static void histogram_add (uint_fast8_t entry, uint_fast8_t bin, uint32_t elapsed)
+{
+    uint_fast8_t idx;
+    uint32_t unit, count, chunk;
+    int32_t *ms = &spindle_account[entry].bin_ms[bin];
+    odometer_histogram_t *histogram = &odometers.rpm_histogram[entry];
+
+    do {
+        // Added in chunks that keep the not yet logged ms positive, a spindle may be logged after running for weeks.
+        chunk = elapsed > ODOMETER_RPM_CHUNK_MAX ? ODOMETER_RPM_CHUNK_MAX : elapsed;
+        elapsed -= chunk;
+        *ms += (int32_t)chunk;
+
+        while(*ms >= (int32_t)((unit = 1000UL << histogram->scale) >> 1)) {
+            count = ((uint32_t)*ms + (unit >> 1)) / unit;
+            if(histogram->bins[bin] + count <= 0xFFFF || histogram->scale == ODOMETER_RPM_SCALE_MAX) {
+                histogram->bins[bin] = histogram->bins[bin] + count > 0xFFFF ? 0xFFFF : histogram->bins[bin] + count;
+                *ms = (int32_t)((int64_t)*ms - (int64_t)count * unit);
+            } else {
+                histogram->scale++;
+                for(idx = 0; idx < ODOMETER_RPM_BINS; idx++) {
+                    spindle_account[entry].bin_ms[idx] += (int32_t)((histogram->bins[idx] & 1) * unit);
+                    histogram->bins[idx] >>= 1;
+                }
             }
-        } while(idx);
+        }
+    } while(elapsed);
+}
+
+#endif
+
+// Close the open run interval of a spindle, revolutions and load are integrated at the rpm and max rpm
+// in effect during the interval. Called by the spindle state hook and by the foreground process with interrupts disabled.
+static inline void spindle_interval_close (uint_fast8_t id, uint32_t ms)
+{
+    uint32_t elapsed = ms - spindle_run[id].ms;
+    float revolutions = spindle_run[id].rpm * (float)elapsed / 60000.0f;
+    spindle_pending_t *pending = &spindle_account[spindle_run[id].entry].pending;
+
+    spindle_run[id].ms = ms;
+    pending->ms += elapsed;
+    pending->revolutions += revolutions;
+    if(spindle_run[id].rpm_max > 0.0f)
+        pending->load += revolutions * 60.0f / spindle_run[id].rpm_max;
+#if ODOMETER_RPM_BINS
+    pending->bin_ms[spindle_run[id].bin] += elapsed;
+#endif
+}
+
+// Add run time of the spindles logged in an entry since the last call to the log and the total spindle run time,
+// along with starts, revolutions and load. Only the foreground process updates the odometers, the intervals closed
+// by the spindle state hook are taken over with interrupts disabled as the hook may be called from interrupt context,
+// e.g. on e-stop.
+static void spindle_time_add (uint_fast8_t entry, uint32_t ms)
+{
+    uint_fast8_t id;
+#if ODOMETER_RPM_BINS
+    uint_fast8_t bin;
+#endif
+    uint32_t count;
+    spindle_pending_t pending;
+
+    hal.irq_disable();
+    for(id = 0; id < N_SPINDLE; id++) {
+        if(spindle_run[id].on && spindle_run[id].entry == entry)
+            spindle_interval_close(id, ms);
+    }
+    memcpy(&pending, &spindle_account[entry].pending, sizeof(spindle_pending_t));
+    memset(&spindle_account[entry].pending, 0, sizeof(spindle_pending_t));
+    hal.irq_enable();
+
+    if(pending.ms)
+        time_add(&odometers.spindle, &spindle_carry, pending.ms);
+
+    if(entry == ODOMETER_SPINDLES)
+        return;
+
+    odometers.spindle_log[entry].starts += pending.starts;
+
+    if(pending.ms == 0)
+        return;
+
+    time_add(&odometers.spindle_log[entry].time, &spindle_account[entry].carry, pending.ms);
+
+#if ODOMETER_RPM_BINS
+    for(bin = 0; bin < ODOMETER_RPM_BINS; bin++) {
+        if(pending.bin_ms[bin])
+            histogram_add(entry, bin, pending.bin_ms[bin]);
+    }
+#endif
+
+    if((spindle_account[entry].revolutions += pending.revolutions) >= 1000.0f) {
+        count = (uint32_t)(spindle_account[entry].revolutions / 1000.0f);
+        odometers.spindle_log[entry].revolutions += count;
+        spindle_account[entry].revolutions -= (float)count * 1000.0f;
+    }
+
+    if((spindle_account[entry].load += pending.load) >= 1.0f) {
+        count = (uint32_t)spindle_account[entry].load;
+        odometers.spindle_log[entry].load += count;
+        spindle_account[entry].load -= (float)count;
+    }
+}
+
+#if ODOMETER_RPM_BINS
+
+// Set the bin width of histograms not yet used from the max rpm of the spindle logged.
+// The width is kept once set so the histogram stays consistent if the max rpm setting is changed.
+static void histograms_init (void)
+{
+    uint_fast8_t entry, id;
+    odometer_histogram_t *histogram;
+
+    for(entry = 0; entry < ODOMETER_SPINDLES; entry++) {
+        histogram = &odometers.rpm_histogram[entry];
+        if(histogram->bin_rpm == 0 && (id = odometers.spindle_id[entry]) < N_SPINDLE && spindle_run[id].rpm_max >= 1.0f)
+            histogram->bin_rpm = (uint16_t)min(((uint32_t)spindle_run[id].rpm_max + ODOMETER_RPM_BINS - 1) / ODOMETER_RPM_BINS, 0xFFFF);
+        spindle_account[entry].bin_scale = histogram->bin_rpm ? 1.0f / (float)histogram->bin_rpm : 0.0f;
+    }
+}
+
+#endif
+
+// Look up the log entry of a spindle, a free entry is assigned to it on first use if available.
+// Called by the spindle state hook when the spindle is first started, spindles that are only selected are not assigned an entry.
+static void spindle_map (uint_fast8_t id)
+{
+    uint_fast8_t entry = 0;
+
+    while(entry < ODOMETER_SPINDLES && odometers.spindle_id[entry] != id)
+        entry++;
+
+    if(entry == ODOMETER_SPINDLES) {
+        entry = 0;
+        while(entry < ODOMETER_SPINDLES && odometers.spindle_id[entry] != ODOMETER_SPINDLE_FREE)
+            entry++;
+        if(entry < ODOMETER_SPINDLES)
+            odometers.spindle_id[entry] = id;
+    }
+
+    spindle_run[id].entry = entry;
+#if ODOMETER_RPM_BINS
+    histograms_init();
+#endif
+}
+
+// Map the spindles in use again after the log entries has been changed.
+static void spindles_map (void)
+{
+    uint_fast8_t id;
+
+    for(id = 0; id < N_SPINDLE; id++) {
+        if(spindle_run[id].entry != ODOMETER_SPINDLE_FREE)
+            spindle_map(id);
+    }
+}
+
+#if ODOMETER_SPINDLE_ENCODER
+
+// Called by foreground process at the sample interval.
+// Measured revolutions are logged whether the spindle is commanded on or not, the speed deviation is sampled
+// over intervals where the spindle has been on at an unchanged commanded rpm for the settle time.
+// The counters are cleared by the driver on some events, e.g. spindle synchronized motion, they are then sampled again.
+// The speed is taken from the counters when these are in use, else the speed reported by the driver is used.
+static void encoder_sample (uint32_t ms)
+{
+    uint_fast8_t id = encoder.id;
+    uint32_t elapsed = ms - encoder.ms, index_count, pulse_count;
+    float rpm, deviation;
+    spindle_data_t *data = encoder.get_data(SpindleData_Counters);
+
+    index_count = data->index_count;
+    pulse_count = data->pulse_count;
+
+    if(index_count || pulse_count)
+        encoder.counting = true;
+
+    if(index_count < encoder.index_count || pulse_count < encoder.pulse_count)
+        encoder.sampled = false;
+
+    if(encoder.sampled && elapsed) {
+
+        if((encoder.revolutions += index_count - encoder.index_count) >= 1000 && spindle_run[id].entry < ODOMETER_SPINDLES) {
+            odometers.encoder_log[spindle_run[id].entry].revolutions += encoder.revolutions / 1000;
+            encoder.revolutions %= 1000;
+        }
+
+        if(spindle_run[id].on && spindle_run[id].rpm > 0.0f && (int32_t)(encoder.ms - spindle_run[id].rpm_ms) >= ODOMETER_ENCODER_SETTLE) {
+            if(!encoder.counting)
+                rpm = encoder.get_data(SpindleData_RPM)->rpm;
+            else if(settings.spindle.ppr)
+                rpm = (float)(pulse_count - encoder.pulse_count) / (float)settings.spindle.ppr * 60000.0f / (float)elapsed;
+            else
+                rpm = (float)(index_count - encoder.index_count) * 60000.0f / (float)elapsed;
+            deviation = (rpm > spindle_run[id].rpm ? rpm - spindle_run[id].rpm : spindle_run[id].rpm - rpm) / spindle_run[id].rpm;
+            encoder.deviation_sum += deviation;
+            if(deviation > encoder.deviation_max)
+                encoder.deviation_max = deviation;
+            encoder.samples++;
+        }
+    }
+
+    encoder.ms = ms;
+    encoder.index_count = index_count;
+    encoder.pulse_count = pulse_count;
+    encoder.sampled = true;
+}
+
+// Called by foreground process when the spindle is stopped, runs without deviation samples keeps the previous values.
+static void encoder_run_end (void)
+{
+    odometer_encoder_t *log = &odometers.encoder_log[spindle_run[encoder.id].entry];
+
+    if(encoder.samples && spindle_run[encoder.id].entry < ODOMETER_SPINDLES) {
+        log->deviation_mean = (uint16_t)min(encoder.deviation_sum * 1000.0f / (float)encoder.samples + 0.5f, 65535.0f);
+        log->deviation_max = (uint16_t)min(encoder.deviation_max * 1000.0f + 0.5f, 65535.0f);
+        encoder.samples = 0;
+        encoder.deviation_sum = encoder.deviation_max = 0.0f;
+    }
+}
+
+#endif
+
+// Add spindle run time since the last call to the odometers, for stopped spindles only that closed by the spindle state hook.
+static void spindles_accumulate (uint32_t ms)
+{
+    uint_fast8_t entry;
+
+    for(entry = 0; entry <= ODOMETER_SPINDLES; entry++)
+        spindle_time_add(entry, ms);
+}
+
+// Add motor and spindle run time and steps output since the last call to the odometers.
+static void odometers_accumulate (uint32_t ms, bool motion)
+{
+    if(motion) {
+        checkpointed = true;
+        time_add(&odometers.motors, &motors_carry, ms - motors_ms);
+        motors_ms = ms;
+    }
+
+    spindles_accumulate(ms);
+    steps_flush();
+}
+
+// Write odometers to NVS while in motion.
+static void odometers_checkpoint (uint32_t ms)
+{
+    checkpoint_ms = ms;
+
+    odometers_accumulate(ms, true);
+    odometers_commit();
+}
+
+// Called by foreground process after a soft reset, alarm or e-stop.
+// Adds motor time up to the reset and steps output since the last fold and writes the odometers.
+static void odometers_abort (void)
+{
+    reset_pending = false;
+
+    spindles_accumulate(hal.get_elapsed_ticks());
+    steps_fold();
+
+    if(motion || odometer_changed || checkpointed) {
+        if(motion) {
+            motion = false;
+            time_add(&odometers.motors, &motors_carry, reset_ms - motors_ms);
+        }
+        checkpointed = false;
+        steps_flush();
+        odometers_commit();
+    }
+}
+
+static void onExecuteRealtime (sys_state_t state)
+{
+    static uint32_t last_ms = 0;
+
+    uint32_t ms = hal.get_elapsed_ticks();
+
+    if(reset_pending)
+        odometers_abort();
+
+    if(commit_pending && !(state & (STATE_CYCLE|STATE_JOG|STATE_HOMING|STATE_SAFETY_DOOR)) &&
+         ms - commit_ms >= ODOMETER_COMMIT_DELAY && (!committed || ms - committed_ms >= commit_interval))
+        odometers_commit();
 
-        nvs.memcpy_to_nvs(odometers_address, (uint8_t *)&odometers, sizeof(odometer_data_t), true);
+    // Write at most one chunk per millisecond.
+    if(storage_busy && storage_ms != ms) {
+        storage_ms = ms;
+        if(!(storage_busy = !storage->commit())) {
+            governor_update();
+#if ODOMETER_POWER_FAIL
+            image_stale = true; // A pending write may have been started.
+#endif
+        }
+    }
+
+    if(ms - last_ms >= ODOMETER_FOLD_INTERVAL) {
+
+        last_ms = ms;
+        steps_fold();
+
+#if ODOMETER_CHECKPOINT_INTERVAL
+        if(checkpoint_interval && (state & (STATE_CYCLE|STATE_JOG|STATE_HOMING|STATE_SAFETY_DOOR)) && ms - checkpoint_ms >= checkpoint_interval)
+            odometers_checkpoint(ms);
+#endif
+
+        // Run time of running spindles is added every fold interval so the time not yet logged stays bounded,
+        // spindles may run for days without motion or with checkpoints disabled.
+        if(spindles_on)
+            spindles_accumulate(ms);
+
+#if ODOMETER_SPINDLE_ENCODER
+        if(encoder.get_data && ms - encoder.ms >= ODOMETER_ENCODER_INTERVAL)
+            encoder_sample(ms);
+#endif
+
+#if ODOMETER_POWER_FAIL
+        // Keep the power fail image up to date, the odometers are updated as for a checkpoint without writing them.
+        if(storage->prepare && !storage_locked && (image_stale || spindles_on || (state & (STATE_CYCLE|STATE_JOG|STATE_HOMING|STATE_SAFETY_DOOR)))) {
+            image_stale = false;
+            odometers_accumulate(ms, !!(state & (STATE_CYCLE|STATE_JOG|STATE_HOMING|STATE_SAFETY_DOOR)));
+            storage->prepare(&odometers);
+        }
+#endif
+    }
+
+    on_execute_realtime(state);
+}
+
+void onStateChanged (sys_state_t state)
+{
+    if(state & (STATE_CYCLE|STATE_JOG|STATE_HOMING|STATE_SAFETY_DOOR)) {
+        motion = true;
+        motors_ms = checkpoint_ms = hal.get_elapsed_ticks();
+        checkpointed = false;
+    } else if(!reset_pending) { // Else the odometers are updated up to the reset and written by odometers_abort().
+
+        steps_fold();
+
+        if(odometer_changed || checkpointed) {
+            checkpointed = false;
+            if(motion)
+                time_add(&odometers.motors, &motors_carry, hal.get_elapsed_ticks() - motors_ms);
+            steps_flush();
+            odometers_commit_request();
+        }
+
+        motion = false;
     }
 
     if(on_state_change)
         on_state_change(state);
 }
 
+// May be called from interrupt context, no NVS I/O here. Only the time of the reset is recorded,
+// the odometers are updated and written by the foreground process on the next pass.
+static void onReset (void)
+{
+    if(!reset_pending) {
+        reset_ms = hal.get_elapsed_ticks();
+        reset_pending = true;
+    }
+
+    if(on_reset)
+        on_reset();
+}
+
+static volatile bool write_queued = false;
+
 // Called by foreground process.
 static void odometers_write (void *data)
 {
-    nvs.memcpy_to_nvs(odometers_address, (uint8_t *)&odometers, sizeof(odometer_data_t), true);
+    write_queued = false;
+    spindles_accumulate(hal.get_elapsed_ticks());
+#if ODOMETER_SPINDLE_ENCODER
+    if(encoder.get_data && !spindle_run[encoder.id].on) {
+        encoder_sample(hal.get_elapsed_ticks());
+        encoder_run_end();
+    }
+#endif
+    odometers_commit_request();
 }
 
 ISR_CODE static void ISR_FUNC(onSpindleSetState)(spindle_ptrs_t *spindle, spindle_state_t state, float rpm)
 {
-    static uint32_t ms = 0;
-
-    spindle_set_state_(spindle, state, rpm);
-
-    if(state.on)
-        ms = hal.get_elapsed_ticks();
-    else if(ms) {
-        odometers.spindle += (hal.get_elapsed_ticks() - ms);
-        ms = 0;
-        // Write odometer data in foreground process.
-        protocol_enqueue_foreground_task(odometers_write, NULL);
+    uint_fast8_t id = spindle->id;
+
+    spindle_run[id].set_state(spindle, state, rpm);
+
+    // Only off to on and on to off edges and speed changes are recorded, calls with
+    // an unchanged state and speed are passed through with two compares.
+    if(state.on != spindle_run[id].on) {
+        if((spindle_run[id].on = state.on)) {
+            if(spindle_run[id].entry == ODOMETER_SPINDLE_FREE)
+                spindle_map(id);
+            spindle_run[id].ms = hal.get_elapsed_ticks();
+            spindle_run[id].rpm = rpm;
+            spindle_run[id].rpm_max = spindle->rpm_max;
+#if ODOMETER_RPM_BINS
+            spindle_run[id].bin = spindle_bin(id, rpm);
+#endif
+#if ODOMETER_SPINDLE_ENCODER
+            spindle_run[id].rpm_ms = spindle_run[id].ms;
+#endif
+            spindle_account[spindle_run[id].entry].pending.starts++;
+            spindles_on |= 1UL << id;
+        } else {
+            spindles_on &= ~(1UL << id);
+            spindle_interval_close(id, hal.get_elapsed_ticks());
+            // Write odometer data in foreground process, only one request is queued at a time.
+            if(!write_queued)
+                write_queued = protocol_enqueue_foreground_task(odometers_write, NULL);
+        }
+    } else if(state.on && rpm != spindle_run[id].rpm) {
+        spindle_interval_close(id, hal.get_elapsed_ticks());
+        spindle_run[id].rpm = rpm;
+        spindle_run[id].rpm_max = spindle->rpm_max;
+#if ODOMETER_RPM_BINS
+        spindle_run[id].bin = spindle_bin(id, rpm);
+#endif
+#if ODOMETER_SPINDLE_ENCODER
+        spindle_run[id].rpm_ms = spindle_run[id].ms;
+#endif
     }
 }
 
+// All spindles are hooked, spindles without a log entry only adds to the total run time.
+// The spindle selected may be a fresh copy of the registered spindle, the entry point is then claimed again.
 static void onSpindleSelected (spindle_ptrs_t *spindle)
 {
-    if(spindle->id == 0 && spindle->set_state != onSpindleSetState) {
-        spindle_set_state_ = spindle->set_state;
+    if((uint_fast8_t)spindle->id < N_SPINDLE && spindle->set_state != onSpindleSetState) {
+        spindle_run[spindle->id].rpm_max = spindle->rpm_max;
+        spindle_run[spindle->id].set_state = spindle->set_state;
         spindle->set_state = onSpindleSetState;
     }
 
+#if ODOMETER_SPINDLE_ENCODER
+    // Run statistics are dropped and the counters sampled again when another spindle or encoder is selected.
+    if(encoder.id != spindle->id || encoder.get_data != spindle->get_data) {
+        encoder.get_data = (uint_fast8_t)spindle->id < N_SPINDLE && spindle_run[spindle->id].entry != ODOMETER_SPINDLES ? spindle->get_data : NULL;
+        encoder.id = spindle->id;
+        encoder.sampled = encoder.counting = false;
+        encoder.revolutions = encoder.samples = 0;
+        encoder.deviation_sum = encoder.deviation_max = 0.0f;
+    }
+#endif
+
     if(on_spindle_selected)
         on_spindle_selected(spindle);
 }
@@ -155,64 +959,457 @@ static void onSpindleSelected (spindle_ptrs_t *spindle)
 // Reclaim entry points that may have been changed on settings change.
 static void onSettingsChanged (settings_t *settings, settings_changed_flags_t changed)
 {
+    bool write;
+    uint_fast8_t idx = N_AXIS;
+
     settings_changed(settings, changed);
 
+    // Pending steps are output with the previous steps/mm setting, account for them
+    // before starting a new steps/mm history entry for axes where the setting has changed.
+    steps_fold();
+    if((write = odometer_changed))
+        steps_flush();
+
+    do {
+        idx--;
+        if(steps_per_mm[idx] != settings->axis[idx].steps_per_mm) {
+            if(steps_get(&odometers, idx, 0) && odometers.steps_per_mm[idx][0] != settings->axis[idx].steps_per_mm) {
+                scale_push(idx, settings->axis[idx].steps_per_mm);
+                write = true;
+            }
+            steps_per_mm[idx] = settings->axis[idx].steps_per_mm;
+        }
+    } while(idx);
+
+    if(write)
+        odometers_commit();
+
+#if ODOMETER_COUNT_SEGMENTS
+
+    if(hal.stepper.cycles_per_tick != stepperCyclesPerTick) {
+        stepper_cycles_per_tick = hal.stepper.cycles_per_tick;
+        hal.stepper.cycles_per_tick = stepperCyclesPerTick;
+    }
+
+    if(hal.stepper.go_idle != stepperGoIdle) {
+        stepper_go_idle = hal.stepper.go_idle;
+        hal.stepper.go_idle = stepperGoIdle;
+    }
+
+#else
+
     if(hal.stepper.pulse_start != stepperPulseStart) {
         stepper_pulse_start = hal.stepper.pulse_start;
         hal.stepper.pulse_start = stepperPulseStart;
     }
+
+    if(hal.stepper.go_idle != stepperGoIdle) {
+        stepper_go_idle = hal.stepper.go_idle;
+        hal.stepper.go_idle = stepperGoIdle;
+    }
+
+#endif
+}
+
+// Write the previous log, if provided, and the current data. Storage keeps the previous log if not.
+static bool odometers_reset (odometer_data_t *previous)
+{
+    bool ok;
+
+    commit_pending = false;
+#if ODOMETER_POWER_FAIL
+    image_stale = true;
+#endif
+
+    if((ok = !storage_locked)) {
+        ok = storage->reset(&odometers, previous);
+        storage_busy = storage->cap.background;
+    }
+
+    return ok;
 }
 
+// The log entries stays assigned to the spindles.
 static void odometer_data_reset (bool backup)
 {
-    if(backup) {
+    uint8_t spindle_id[ODOMETER_SPINDLES];
+
+    spindles_accumulate(hal.get_elapsed_ticks());
+
+    if(backup)
         memcpy(&odometers_prv, &odometers, sizeof(odometer_data_t));
-        nvs.memcpy_to_nvs(odometers_address_prv, (uint8_t *)&odometers_prv, sizeof(odometer_data_t), true);
+    memcpy(spindle_id, odometers.spindle_id, sizeof(spindle_id));
+    odometer_data_clear(&odometers);
+    memcpy(odometers.spindle_id, spindle_id, sizeof(spindle_id));
+#if ODOMETER_RPM_BINS
+    histograms_init();
+#endif
+
+    odometers_reset(backup ? &odometers_prv : NULL);
+}
+
+static void odometer_data_migrate (odometer_data_t *odometers, odometer_data_v006_t *legacy)
+{
+    uint_fast8_t idx;
+
+    odometer_data_clear(odometers);
+
+    odometers->motors = (uint32_t)(legacy->motors / 1000);
+    odometers->spindle = odometers->spindle_log[0].time = (uint32_t)(legacy->spindle / 1000);
+    if(odometers->spindle)
+        odometers->spindle_id[0] = 0;
+
+    for(idx = 0 ; idx < N_AXIS ; idx++) {
+        odometers->steps_per_mm[idx][0] = settings.axis[idx].steps_per_mm;
+        steps_set(odometers, idx, 0, (uint64_t)(legacy->distance[idx] * odometers->steps_per_mm[idx][0] + 0.5f));
     }
-    memset(&odometers, 0, sizeof(odometer_data_t));
-    nvs.memcpy_to_nvs(odometers_address, (uint8_t *)&odometers, sizeof(odometer_data_t), true);
+}
+
+// Called by foreground process when settings has been loaded.
+// Converts v0.06 data from distance to steps, resets data if not available.
+// The v0.06 data is kept by storage until the converted data has been written.
+static void odometers_migrate (void *data)
+{
+    odometer_data_v006_t legacy;
+    uint32_t address = NVS_SIZE - (sizeof(odometer_data_v006_t) + NVS_CRC_BYTES);
+
+    if(nvs.memcpy_from_nvs((uint8_t *)&legacy, address, sizeof(odometer_data_v006_t), true) == NVS_TransferResult_OK) {
+
+        odometer_data_migrate(&odometers, &legacy);
+        spindles_map();
+
+        address -= sizeof(odometer_data_v006_t) + NVS_CRC_BYTES;
+        if(nvs.memcpy_from_nvs((uint8_t *)&legacy, address, sizeof(odometer_data_v006_t), true) == NVS_TransferResult_OK) {
+            odometer_data_migrate(&odometers_prv, &legacy);
+            odometers_reset(&odometers_prv);
+        } else
+            odometers_reset(NULL);
+    } else
+        odometer_data_reset(false);
+}
+
+// Offsets of the fields of odometer data stored with a version and configuration, 0 for optional blocks not stored.
+typedef struct {
+    uint8_t axes;
+    uint8_t history;
+    uint8_t spindles;
+    uint8_t bins;
+    uint32_t size;
+    uint32_t spindle_id;
+    uint32_t spindle_log;
+    uint32_t encoder_log;
+    uint32_t steps_per_mm;
+    uint32_t steps;
+    uint32_t steps_hi;
+    uint32_t rpm_histogram;
+} odometer_layout_t;
+
+#define LAYOUT_ALIGN(offset, n) (((offset) + (n) - 1) & ~((n) - 1))
+
+// Returns false if the version is not known. The version and configuration fields at the start are common to all versions,
+// followed by the motors and spindle run times. When ODOMETER_DATA_VERSION is incremented add a case for the new layout,
+// the element sizes of the previous layouts are then to be read from here.
+static bool odometer_layout (odometer_layout_t *layout, const uint8_t *head)
+{
+    uint32_t offset;
+
+    layout->axes = head[1];
+    layout->history = head[2];
+    layout->spindles = head[3];
+    layout->bins = head[4];
+
+    if(layout->axes == 0 || layout->history == 0 || layout->spindles == 0)
+        return false;
+
+    switch(head[0]) {
+
+        // Encoder log and histograms always stored.
+        case 1:
+            if(layout->bins == 0)
+                return false;
+            layout->spindle_id = offset = 16;
+            layout->spindle_log = offset = LAYOUT_ALIGN(offset + layout->spindles, 4);
+            layout->encoder_log = offset = offset + layout->spindles * sizeof(odometer_spindle_t);
+            layout->steps_per_mm = offset = offset + layout->spindles * sizeof(odometer_encoder_t);
+            layout->steps = offset = offset + layout->axes * layout->history * sizeof(float);
+            layout->steps_hi = offset = offset + layout->axes * layout->history * sizeof(uint32_t);
+            layout->rpm_histogram = offset = LAYOUT_ALIGN(offset + layout->axes * layout->history * sizeof(uint16_t), 2);
+            offset += layout->spindles * (2 + layout->bins) * sizeof(uint16_t);
+            break;
+
+        // Encoder log stored if flagged in the blocks field, histograms if the number of bins is not 0.
+        case 2:
+            layout->spindle_id = offset = 16;
+            layout->spindle_log = offset = LAYOUT_ALIGN(offset + layout->spindles, 4);
+            offset += layout->spindles * sizeof(odometer_spindle_t);
+            if(head[5] & ODOMETER_BLOCK_ENCODER) {
+                layout->encoder_log = offset;
+                offset += layout->spindles * sizeof(odometer_encoder_t);
+            } else
+                layout->encoder_log = 0;
+            layout->steps_per_mm = offset;
+            layout->steps = offset = offset + layout->axes * layout->history * sizeof(float);
+            layout->steps_hi = offset = offset + layout->axes * layout->history * sizeof(uint32_t);
+            offset += layout->axes * layout->history * sizeof(uint16_t);
+            if(layout->bins) {
+                layout->rpm_histogram = offset = LAYOUT_ALIGN(offset, 2);
+                offset += layout->spindles * (2 + layout->bins) * sizeof(uint16_t);
+            } else
+                layout->rpm_histogram = 0;
+            break;
+
+        default:
+            return false;
+    }
+
+    layout->size = LAYOUT_ALIGN(offset, 4);
+
+    return true;
+}
+
+#if ODOMETER_RPM_BINS
+
+// Rebin a histogram stored with another number of bins, the time of each bin stored is added to the bin
+// holding its center rpm. The rpm range covered is kept, bins are halved if needed to fit.
+static bool histogram_import (odometer_histogram_t *histogram, odometer_layout_t *layout, uint32_t offset, odometer_read_ptr read)
+{
+    uint16_t count;
+    uint32_t time[ODOMETER_RPM_BINS] = {0}, bin_rpm, rpm;
+    uint_fast8_t idx, bin;
+    bool halve;
+
+    if(!read(histogram, offset, offsetof(odometer_histogram_t, bins)))
+        return false;
+
+    if(layout->bins == ODOMETER_RPM_BINS)
+        return read(histogram->bins, offset + offsetof(odometer_histogram_t, bins), sizeof(histogram->bins));
+
+    bin_rpm = histogram->bin_rpm;
+    histogram->bin_rpm = (uint16_t)min((bin_rpm * layout->bins + ODOMETER_RPM_BINS - 1) / ODOMETER_RPM_BINS, 0xFFFF);
+
+    for(idx = 0; idx < layout->bins && histogram->bin_rpm; idx++) {
+        if(!read(&count, offset + offsetof(odometer_histogram_t, bins) + idx * sizeof(uint16_t), sizeof(uint16_t)))
+            return false;
+        rpm = bin_rpm * idx + bin_rpm / 2;
+        bin = rpm / histogram->bin_rpm < ODOMETER_RPM_BINS ? rpm / histogram->bin_rpm : ODOMETER_RPM_BINS - 1;
+        time[bin] += count;
+    }
+
+    do {
+        halve = false;
+        for(idx = 0; idx < ODOMETER_RPM_BINS; idx++)
+            halve |= time[idx] > 0xFFFF;
+        if(halve && histogram->scale < ODOMETER_RPM_SCALE_MAX) {
+            histogram->scale++;
+            for(idx = 0; idx < ODOMETER_RPM_BINS; idx++)
+                time[idx] = (time[idx] + 1) >> 1;
+        } else
+            halve = false;
+    } while(halve);
+
+    for(idx = 0; idx < ODOMETER_RPM_BINS; idx++)
+        histogram->bins[idx] = (uint16_t)min(time[idx], 0xFFFF);
+
+    return true;
+}
+
+#endif
+
+// Copy the fields known from data stored with another version or configuration, data is cleared before calling.
+// Optional blocks not stored or not enabled are skipped.
+// Log entries of spindles beyond ODOMETER_SPINDLES are dropped, the run time is kept in the total.
+// Steps/mm history entries beyond ODOMETER_SCALE_HISTORY are merged into the oldest entry kept as by scale_push().
+static bool odometer_data_import (odometer_data_t *odometers, uint32_t size, odometer_read_ptr read)
+{
+    uint8_t head[4 + sizeof(uint32_t)];
+    uint32_t steps_lo;
+    uint16_t steps_hi;
+    uint64_t steps;
+    float steps_per_mm;
+    odometer_layout_t layout;
+    uint_fast8_t idx, entry, keep;
+    bool ok;
+
+    if(!(read(head, 0, sizeof(head)) && odometer_layout(&layout, head) && layout.size == size &&
+          read(&odometers->motors, 8, sizeof(uint32_t)) && read(&odometers->spindle, 12, sizeof(uint32_t))))
+        return false;
+
+    for(idx = 0; idx < min(layout.spindles, ODOMETER_SPINDLES); idx++) {
+        if(!(read(&odometers->spindle_id[idx], layout.spindle_id + idx, sizeof(uint8_t)) &&
+              read(&odometers->spindle_log[idx], layout.spindle_log + idx * sizeof(odometer_spindle_t), sizeof(odometer_spindle_t))))
+            return false;
+#if ODOMETER_SPINDLE_ENCODER
+        if(layout.encoder_log && !read(&odometers->encoder_log[idx], layout.encoder_log + idx * sizeof(odometer_encoder_t), sizeof(odometer_encoder_t)))
+            return false;
+#endif
+#if ODOMETER_RPM_BINS
+        if(layout.rpm_histogram && !histogram_import(&odometers->rpm_histogram[idx], &layout, layout.rpm_histogram + idx * (2 + layout.bins) * sizeof(uint16_t), read))
+            return false;
+#endif
+    }
+
+    for(idx = 0; idx < min(layout.axes, N_AXIS); idx++) {
+        for(entry = 0; entry < layout.history; entry++) {
+            ok = read(&steps_per_mm, layout.steps_per_mm + (idx * layout.history + entry) * sizeof(float), sizeof(float)) &&
+                  read(&steps_lo, layout.steps + (idx * layout.history + entry) * sizeof(uint32_t), sizeof(uint32_t)) &&
+                   read(&steps_hi, layout.steps_hi + (idx * layout.history + entry) * sizeof(uint16_t), sizeof(uint16_t));
+            if(!ok)
+                return false;
+            steps = (uint64_t)steps_hi << 32 | steps_lo;
+            keep = entry < ODOMETER_SCALE_HISTORY ? entry : ODOMETER_SCALE_HISTORY - 1;
+            if(entry == keep || steps_get(odometers, idx, keep) == 0) {
+                odometers->steps_per_mm[idx][keep] = steps_per_mm;
+                steps_set(odometers, idx, keep, steps);
+            } else if(steps && steps_per_mm > 0.0f)
+                steps_set(odometers, idx, keep, steps_get(odometers, idx, keep) +
+                           (uint64_t)((double)steps * odometers->steps_per_mm[idx][keep] / steps_per_mm + 0.5));
+        }
+    }
+
+    return true;
+}
+
+// Import data stored with another layout from storage, e.g. written by an older version or with other configuration.
+static bool odometers_import (odometer_data_t *odometers, bool previous)
+{
+    odometer_record_header_t header;
+
+    bool ok = storage->open && storage->open(previous, &header) && odometer_data_import(odometers, header.size, storage->read);
+
+    if(!ok)
+        odometer_data_clear(odometers);
+
+    return ok;
+}
+
+// Called by foreground process, writes the imported data with the current layout.
+static void odometers_imported (void *data)
+{
+    odometers_reset(&odometers_prv);
 }
 
 static void odometers_report (odometer_data_t *odometers)
 {
-    char buf[40];
+    char buf[60];
     uint_fast8_t idx;
-    uint32_t hr = odometers->spindle / 3600000, min = (odometers->spindle / 60000) % 60;
+    uint32_t hr = odometers->spindle / 3600, min = (odometers->spindle / 60) % 60;
 
-    sprintf(buf, "SPINDLEHRS %ld:%.2ld", hr, min);
+    sprintf(buf, "SPINDLEHRS %lu:%.2lu", (unsigned long)hr, (unsigned long)min);
     report_message(buf, Message_Plain);
 
-    hr = odometers->motors / 3600000;
-    min = (odometers->motors / 60000) % 60;
+    for(idx = 0 ; idx < ODOMETER_SPINDLES ; idx++) {
+        if(odometers->spindle_log[idx].starts || odometers->spindle_log[idx].time) {
+            hr = odometers->spindle_log[idx].time / 3600;
+            min = (odometers->spindle_log[idx].time / 60) % 60;
+            sprintf(buf, "SPINDLEHRS%d %lu:%.2lu STARTS %lu", (int)odometers->spindle_id[idx], (unsigned long)hr, (unsigned long)min, (unsigned long)odometers->spindle_log[idx].starts);
+            report_message(buf, Message_Plain);
+            hr = odometers->spindle_log[idx].load / 3600;
+            min = (odometers->spindle_log[idx].load / 60) % 60;
+            sprintf(buf, "SPINDLELOAD%d %lu:%.2lu KREVS %lu", (int)odometers->spindle_id[idx], (unsigned long)hr, (unsigned long)min, (unsigned long)odometers->spindle_log[idx].revolutions);
+#if ODOMETER_SPINDLE_POWER
+            strcat(buf, " KWH ");
+            strcat(buf, ftoa((float)odometers->spindle_log[idx].load * (float)ODOMETER_SPINDLE_POWER / 3600000.0f, 1));
+#endif
+            report_message(buf, Message_Plain);
+#if ODOMETER_SPINDLE_ENCODER
+            if(odometers->encoder_log[idx].revolutions || odometers->encoder_log[idx].deviation_max) {
+                sprintf(buf, "SPINDLEENC%d KREVS %lu DEV %s", (int)odometers->spindle_id[idx], (unsigned long)odometers->encoder_log[idx].revolutions,
+                                                                 ftoa((float)odometers->encoder_log[idx].deviation_mean / 10.0f, 1));
+                strcat(buf, "/");
+                strcat(buf, ftoa((float)odometers->encoder_log[idx].deviation_max / 10.0f, 1));
+                strcat(buf, "%");
+                report_message(buf, Message_Plain);
+            }
+#endif
+        }
+    }
+
+    hr = odometers->motors / 3600;
+    min = (odometers->motors / 60) % 60;
 
-    sprintf(buf, "MOTORHRS %ld:%.2ld", hr, min);
+    sprintf(buf, "MOTORHRS %lu:%.2lu", (unsigned long)hr, (unsigned long)min);
     report_message(buf, Message_Plain);
 
     for(idx = 0 ; idx < N_AXIS ; idx++) {
-        sprintf(buf, "ODOMETER%s %s", axis_letter[idx], ftoa(odometers->distance[idx] / 1000.0f, 1)); // meters
+        sprintf(buf, "ODOMETER%s %s", axis_letter[idx], ftoa(odometer_distance(odometers, idx) / 1000.0f, 1)); // meters
         report_message(buf, Message_Plain);
     }
 }
 
+#if ODOMETER_RPM_BINS
+
+// Run time per rpm band, only bins with time logged are listed.
+static void histograms_report (odometer_data_t *odometers)
+{
+    char buf[60];
+    uint_fast8_t entry, bin;
+    uint32_t hr, min, rpm;
+    uint64_t seconds;
+    odometer_histogram_t *histogram;
+
+    for(entry = 0 ; entry < ODOMETER_SPINDLES ; entry++) {
+        histogram = &odometers->rpm_histogram[entry];
+        for(bin = 0 ; bin < ODOMETER_RPM_BINS ; bin++) {
+            if(histogram->bins[bin]) {
+                seconds = (uint64_t)histogram->bins[bin] << histogram->scale;
+                hr = (uint32_t)(seconds / 3600);
+                min = (uint32_t)(seconds / 60) % 60;
+                rpm = (uint32_t)bin * histogram->bin_rpm;
+                if(bin == ODOMETER_RPM_BINS - 1)
+                    sprintf(buf, "SPINDLE%d %lu+ %lu:%.2lu", (int)odometers->spindle_id[entry], (unsigned long)rpm, (unsigned long)hr, (unsigned long)min);
+                else
+                    sprintf(buf, "SPINDLE%d %lu-%lu %lu:%.2lu", (int)odometers->spindle_id[entry], (unsigned long)rpm, (unsigned long)(rpm + histogram->bin_rpm), (unsigned long)hr, (unsigned long)min);
+                report_message(buf, Message_Plain);
+            }
+        }
+    }
+}
+
+#endif
+
 static status_code_t odometer_command (sys_state_t state, char *args)
 {
+    char buf[60];
     status_code_t retval = Status_Unhandled;
 
     if(args == NULL) {
         odometers_report(&odometers);
+        if(storage_busy) {
+            sprintf(buf, "NVSWRITE %d/%d", (int)(sizeof(odometer_record_t) - storage->status->pending), (int)sizeof(odometer_record_t));
+            report_message(buf, Message_Plain);
+        }
+        sprintf(buf, "NVSWRITES %lu/%lu %s", (unsigned long)storage->status->writes, (unsigned long)storage->status->seq, storage->name);
+        report_message(buf, Message_Plain);
+        if(storage->cap.rotating) {
+            sprintf(buf, "NVSLIFE %s", ftoa(nvs_life, 1)); // years
+            report_message(buf, Message_Plain);
+            sprintf(buf, "COMMITINTERVAL %lu", (unsigned long)(commit_interval / 1000)); // seconds
+            report_message(buf, Message_Plain);
+        }
+        sprintf(buf, "CHECKPOINT %lu", (unsigned long)(checkpoint_interval / 1000)); // seconds
+        report_message(buf, Message_Plain);
+        sprintf(buf, "RECOVERY %luus SLOT %d", (unsigned long)recovery_us, (int)storage->status->slot);
+        report_message(buf, Message_Plain);
         retval = Status_OK;
     } else {
 
         strcaps(args);
 
         if(!strcmp(args, "PREV")) {
-            if(nvs.memcpy_from_nvs((uint8_t *)&odometers_prv, odometers_address_prv, sizeof(odometer_data_t), true) == NVS_TransferResult_OK)
+            if(storage->load_previous(&odometers_prv))
                 odometers_report(&odometers_prv);
             else
                 report_message("Previous odometer values not available", Message_Warning);
             retval = Status_OK;
         }
 
+#if ODOMETER_RPM_BINS
+        if(!strcmp(args, "SPINDLE")) {
+            histograms_report(&odometers);
+            retval = Status_OK;
+        }
+#endif
+
         if(!strcmp(args, "RST")) {
             odometer_data_reset(true);
             retval = Status_OK;
@@ -226,6 +1423,9 @@ const sys_command_t odometer_command_list[] = {
     {"ODOMETERS", odometer_command, {}, {
         .str = "$ODOMETERS - list odometer log"
      ASCII_EOL "$ODOMETERS=PREV - list previous odometer log when available"
+#if ODOMETER_RPM_BINS
+     ASCII_EOL "$ODOMETERS=SPINDLE - list spindle run time per rpm band"
+#endif
      ASCII_EOL "$ODOMETERS=RST - copy current log to previous and clear current"
     } }
 };
@@ -242,42 +1442,151 @@ static void onReportOptions (bool newopt)
     if(newopt)
         hal.stream.write(",ODO");
     else
-        hal.stream.write("[PLUGIN:ODOMETERS v0.06]" ASCII_EOL);
+        hal.stream.write("[PLUGIN:ODOMETERS v0.07]" ASCII_EOL);
+}
+
+// Called from the driver power fail or brown-out interrupt handler, writes the
+// prepared odometer data image in a single NVS write. Returns false if not available.
+// Skipped while a background write is in progress as the interrupt may have preempted an NVS transfer,
+// the data of the last completed write is then kept.
+bool odometer_power_fail (void)
+{
+    return storage && storage->flush && !storage_locked && !storage_busy && storage->flush();
+}
+
+#ifndef ODOMETER_FILE
+
+// Plugins may allocate NVS space for their settings after odometer_init() has been called,
+// the space used for odometer data is checked when all plugins has been initialized.
+static void odometers_check_nvs (void *data)
+{
+    if(storage && (storage_locked = GRBL_NVS_SIZE + hal.nvs.driver_area.size > storage->status->address))
+        report_warning("NVS space for odometers used by other plugins, odometers will not be saved!");
+}
+
+#endif
+
+void odometer_flash_attach (const odometer_flash_t *flash_io)
+{
+    flash = flash_io;
 }
 
 void odometer_init()
 {
+    bool ok, legacy = false;
+    uint_fast8_t idx;
+
     memcpy(&nvs, nvs_buffer_get_physical(), sizeof(nvs_io_t));
 
-    if(!(nvs.type == NVS_EEPROM || nvs.type == NVS_FRAM))
-        protocol_enqueue_foreground_task(report_warning, "EEPROM or FRAM is required for odometers!");
-    else if(NVS_SIZE - GRBL_NVS_SIZE - hal.nvs.driver_area.size < ((sizeof(odometer_data_t) + NVS_CRC_BYTES) * 2))
-        protocol_enqueue_foreground_task(report_warning, "Not enough NVS storage for odometers!");
-    else {
+#ifdef ODOMETER_FILE
+
+    nvs_io_t *file;
+
+    if((file = odometer_file_open(ODOMETER_FILE, ODOMETER_FILE_SIZE)) && (storage = odometer_journal_init(file, 0, ODOMETER_FILE_SIZE)))
+        nvs_endurance = ODOMETER_EEPROM_ENDURANCE;
+    else
+        protocol_enqueue_foreground_task(report_warning, "Failed to open odometer file!");
+
+#else
+
+    if(nvs.type == NVS_EEPROM || nvs.type == NVS_FRAM) {
+
+        // Use the spare NVS space above the driver area.
+        if((storage = odometer_journal_init(&nvs, GRBL_NVS_SIZE + hal.nvs.driver_area.size, NVS_SIZE - GRBL_NVS_SIZE - hal.nvs.driver_area.size))) {
+            legacy = true;
+            protocol_enqueue_foreground_task(odometers_check_nvs, NULL);
+            nvs_endurance = nvs.type == NVS_FRAM ? ODOMETER_FRAM_ENDURANCE : ODOMETER_EEPROM_ENDURANCE;
+        } else
+            protocol_enqueue_foreground_task(report_warning, "Not enough NVS storage for odometers!");
+
+    } else if(flash) {
 
-        odometers_address = NVS_SIZE - (sizeof(odometer_data_t) + NVS_CRC_BYTES);
-        odometers_address_prv = odometers_address - (sizeof(odometer_data_t) + NVS_CRC_BYTES);
+        if(!(storage = odometer_flash_init(flash)))
+            protocol_enqueue_foreground_task(report_warning, "Flash sector too small for odometers!");
 
-        if(nvs.memcpy_from_nvs((uint8_t *)&odometers, odometers_address, sizeof(odometer_data_t), true) != NVS_TransferResult_OK)
-            odometer_data_reset(false);
+    } else
+        protocol_enqueue_foreground_task(report_warning, "EEPROM, FRAM or flash log is required for odometers!");
+
+#endif
+
+    if(storage) {
+
+        uint32_t us = hal.get_micros ? hal.get_micros() : hal.get_elapsed_ticks() * 1000;
+
+        ok = storage->load(&odometers) && odometer_data_valid(&odometers);
+        recovery_us = (hal.get_micros ? hal.get_micros() : hal.get_elapsed_ticks() * 1000) - us;
+
+        if(!ok) {
+            odometer_data_clear(&odometers);
+            odometer_data_clear(&odometers_prv);
+            if(odometers_import(&odometers, false)) {
+                odometers_import(&odometers_prv, true);
+                protocol_enqueue_foreground_task(odometers_imported, NULL);
+            } else if(legacy)
+                protocol_enqueue_foreground_task(odometers_migrate, NULL);
+            else {
+                odometers_import(&odometers_prv, true); // The previous log is kept if still readable.
+                if(!odometers_reset(&odometers_prv)) {
+                    storage = NULL;
+                    protocol_enqueue_foreground_task(report_warning, "Failed to initialize odometer storage!");
+                }
+            }
+        }
+    }
+
+    if(storage) {
 
         hal.driver_cap.odometers = On;
 
+        // Writes that are not completed in the background may stall the stepper interrupt, e.g. flash program and erase
+        // on single bank MCUs, no checkpoints are then written and the odometers are written when motion stops.
+        if(!storage->cap.background)
+            checkpoint_interval = 0;
+
+        // Set the write intervals and estimated life before the first write completes.
+        governor_update();
+
         on_state_change = grbl.on_state_change;
         grbl.on_state_change = onStateChanged;
 
+        on_execute_realtime = grbl.on_execute_realtime;
+        grbl.on_execute_realtime = onExecuteRealtime;
+
         on_report_options = grbl.on_report_options;
         grbl.on_report_options = onReportOptions;
 
         settings_changed = hal.settings_changed;
         hal.settings_changed = onSettingsChanged;
 
+        for(idx = 0; idx < N_SPINDLE; idx++)
+            spindle_run[idx].entry = ODOMETER_SPINDLE_FREE;
+
         on_spindle_selected = grbl.on_spindle_selected;
         grbl.on_spindle_selected = onSpindleSelected;
 
+        on_reset = grbl.on_reset;
+        grbl.on_reset = onReset;
+
+#if ODOMETER_COUNT_SEGMENTS
+
+        stepper_cycles_per_tick = hal.stepper.cycles_per_tick;
+        hal.stepper.cycles_per_tick = stepperCyclesPerTick;
+
+        stepper_go_idle = hal.stepper.go_idle;
+        hal.stepper.go_idle = stepperGoIdle;
+
+#else
+
+        lanes_init();
+
         stepper_pulse_start = hal.stepper.pulse_start;
         hal.stepper.pulse_start = stepperPulseStart;
 
+        stepper_go_idle = hal.stepper.go_idle;
+        hal.stepper.go_idle = stepperGoIdle;
+
+#endif
+
         system_register_commands(&odometer_commands);
     }
 }
@@ -24,6 +24,23 @@
 #ifndef _ODOMETER_H_
 #define _ODOMETER_H_
 
+#include <stdint.h>
+#include <stdbool.h>
+
+// Flash access provided by drivers without EEPROM or FRAM, two sectors are used for a log of odometer data.
+// Offsets are relative to the start of the first sector, the second sector follows immediately.
+typedef struct {
+    uint32_t sector_size;                                               // Erase unit in bytes.
+    bool (*erase)(uint_fast8_t sector);                                 // Erase sector 0 or 1, all bytes are set to 0xFF.
+    bool (*program)(uint32_t offset, const void *data, uint32_t size);  // Program erased bytes, offset and size are multiples of 4.
+    bool (*read)(void *data, uint32_t offset, uint32_t size);
+} odometer_flash_t;
+
+typedef uint16_t (*odometer_crc16_ptr)(uint16_t crc, const void *data, uint32_t size); // CRC-16/CCITT, polynomial 0x1021, not reflected.
+
 void odometer_init();
+void odometer_flash_attach (const odometer_flash_t *flash); // Call before odometer_init().
+void odometer_crc_attach (odometer_crc16_ptr crc16);        // Optional hardware CRC, call before odometer_init().
+bool odometer_power_fail (void);                            // Call from power fail interrupt, requires ODOMETER_POWER_FAIL enabled.
 
 #endif
@@ -0,0 +1,97 @@
+/*
+
+  odometer_file.c - file backed NVS for odometer data
+
+  Part of grblHAL
+
+  Copyright (c) 2026 agent
+
+  Grbl is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Grbl is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Grbl.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifdef ARDUINO
+#include "../driver.h"
+#else
+#include "driver.h"
+#endif
+
+#if ODOMETER_ENABLE && defined(ODOMETER_FILE)
+
+// Emulates EEPROM with a file for POSIX targets such as simulators and host builds,
+// the journal is used as for EEPROM so its behaviour can be exercised without hardware.
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "odometer_storage.h"
+
+#ifndef ODOMETER_FILE_WRITE_DELAY
+#define ODOMETER_FILE_WRITE_DELAY 0 // us, delay per write to emulate EEPROM write cycle time.
+#endif
+
+static int fd = -1;
+static nvs_io_t file_nvs;
+
+static nvs_transfer_result_t file_to_nvs (uint32_t destination, uint8_t *source, uint32_t size, bool with_checksum)
+{
+    if(with_checksum || destination + size > file_nvs.size ||
+        pwrite(fd, source, size, destination) != (ssize_t)size || fsync(fd))
+        return NVS_TransferResult_Failed;
+
+#if ODOMETER_FILE_WRITE_DELAY
+    usleep(ODOMETER_FILE_WRITE_DELAY);
+#endif
+
+    return NVS_TransferResult_OK;
+}
+
+static nvs_transfer_result_t file_from_nvs (uint8_t *destination, uint32_t source, uint32_t size, bool with_checksum)
+{
+    ssize_t count;
+
+    if(with_checksum || source + size > file_nvs.size || (count = pread(fd, destination, size, source)) < 0)
+        return NVS_TransferResult_Failed;
+
+    // Bytes not yet written reads as erased EEPROM.
+    while(count < (ssize_t)size)
+        destination[count++] = 0xFF;
+
+    return NVS_TransferResult_OK;
+}
+
+// Returns NULL if the file cannot be opened or created.
+nvs_io_t *odometer_file_open (const char *path, uint32_t size)
+{
+    off_t end;
+    uint8_t erased = 0xFF;
+
+    if(fd == -1 && (fd = open(path, O_RDWR|O_CREAT, 0644)) == -1)
+        return NULL;
+
+    // Extend a new or short file with erased bytes.
+    if((end = lseek(fd, 0, SEEK_END)) >= 0) {
+        while(end < (off_t)size && pwrite(fd, &erased, 1, end) == 1)
+            end++;
+    }
+
+    file_nvs.type = NVS_EEPROM;
+    file_nvs.size = size;
+    file_nvs.memcpy_to_nvs = file_to_nvs;
+    file_nvs.memcpy_from_nvs = file_from_nvs;
+
+    return &file_nvs;
+}
+
+#endif
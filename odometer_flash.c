@@ -0,0 +1,373 @@
+/*
+
+  odometer_flash.c - odometer data log for flash
+
+  Part of grblHAL
+
+  Copyright (c) 2026 agent
+
+  Grbl is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Grbl is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Grbl.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifdef ARDUINO
+#include "../driver.h"
+#else
+#include "driver.h"
+#endif
+
+#if ODOMETER_ENABLE
+
+#include <string.h>
+
+#include "odometer_storage.h"
+
+// Flash log, used when no EEPROM or FRAM is available and the driver provides flash access.
+// Each sector holds a header, a full record of current and previous data and a log of changes.
+// A commit appends an entry for each 32-bit word of the data that has changed followed by a
+// commit entry, when the sector is full the current data is written to the other sector which
+// then becomes the active sector. The header is written last, if the write is interrupted
+// the previous sector remains active. Entries following the last commit entry are ignored,
+// as are the entries of a commit with a corrupt entry. Flash is only written when motion has stopped.
+// When the record layout is changed the data stored is located and read for import by the record size stored.
+
+#define FLASH_MAGIC 0x4D4F444F          // "ODOM"
+#define FLASH_ENTRY_ERASED 0xFFFF
+#define FLASH_ENTRY_COMMIT 0xFFFE
+#define FLASH_RECORD_SIZE FLASH_RECORD_ALIGN(sizeof(odometer_record_t))
+#define FLASH_RECORD_ALIGN(size) (((size) + 3) & ~3)
+#define FLASH_LOG_OFFSET (sizeof(flash_header_t) + FLASH_RECORD_SIZE * 2)
+#define FLASH_WORDS (sizeof(odometer_data_t) / sizeof(uint32_t))
+
+typedef struct {
+    uint32_t magic;
+    uint32_t generation;
+} flash_header_t;
+
+typedef struct {
+    uint16_t index;                 // Index of changed 32-bit word in odometer data or FLASH_ENTRY_COMMIT.
+    uint16_t crc;
+    uint32_t value;                 // New value or sequence number of commit entry.
+} flash_entry_t;
+
+static const odometer_flash_t *flash;
+static uint_fast8_t flash_sector = 0;
+static uint32_t flash_offset, flash_generation = 0;
+static odometer_record_t record;    // The data as of the last commit.
+static odometer_storage_status_t status = {0};
+static struct {
+    uint32_t address;               // Address of the data of the record located by flash_open().
+    uint32_t log;                   // Address of the log to replay on the data read, 0 if none.
+    uint32_t log_end;
+} opened = {0};
+
+static inline uint32_t sector_address (uint_fast8_t sector)
+{
+    return sector * flash->sector_size;
+}
+
+static uint16_t flash_entry_crc (flash_entry_t *entry)
+{
+    return odometer_crc16(odometer_crc16(0xFFFF, &entry->index, sizeof(uint16_t)), &entry->value, sizeof(uint32_t));
+}
+
+static bool flash_record_write (uint32_t offset, odometer_data_t *data, uint32_t seq)
+{
+    memcpy(&record.data, data, sizeof(odometer_data_t));
+    odometer_record_seal(&record.header, &record.data, seq);
+    status.writes++;
+
+    return flash->program(offset, &record, FLASH_RECORD_SIZE);
+}
+
+static bool flash_record_read (uint32_t offset, odometer_data_t *data, uint32_t *seq)
+{
+    odometer_record_header_t header;
+
+    bool ok = flash->read(&header, offset, sizeof(odometer_record_header_t)) &&
+               flash->read(data, offset + sizeof(odometer_record_header_t), sizeof(odometer_data_t)) &&
+                odometer_record_valid(&header, data);
+
+    if(ok && seq)
+        *seq = header.seq;
+
+    return ok;
+}
+
+static bool flash_load_previous (odometer_data_t *data)
+{
+    return flash_record_read(sector_address(flash_sector) + sizeof(flash_header_t) + FLASH_RECORD_SIZE, data, NULL);
+}
+
+// Write current and previous data to the inactive sector and make it the active sector.
+// The previous data is copied from the active sector if not provided.
+// On return the record image holds the current data as written.
+static bool flash_compact (odometer_data_t *current, odometer_data_t *previous)
+{
+    bool ok;
+    odometer_data_t copy;
+    uint_fast8_t sector = flash_sector ^ 1;
+    uint32_t base = sector_address(sector);
+    flash_header_t header = {
+        .magic = FLASH_MAGIC,
+        .generation = flash_generation + 1
+    };
+
+    if(previous == NULL && !flash_load_previous(previous = &copy))
+        memset(previous, 0, sizeof(odometer_data_t));
+
+    if((ok = flash->erase(sector) &&
+              flash_record_write(base + sizeof(flash_header_t) + FLASH_RECORD_SIZE, previous, 0) &&
+               flash_record_write(base + sizeof(flash_header_t), current, status.seq) &&
+                flash->program(base, &header, sizeof(flash_header_t)))) {
+        status.slot = flash_sector = sector;
+        flash_generation = header.generation;
+        flash_offset = FLASH_LOG_OFFSET;
+    }
+
+    return ok;
+}
+
+// Append entries for the words that has changed since the last commit.
+static void flash_write (odometer_data_t *odometers)
+{
+    flash_entry_t entry;
+    uint32_t *data = (uint32_t *)odometers, *committed = (uint32_t *)&record.data;
+    uint_fast16_t idx, changed = 0;
+
+    for(idx = 0; idx < FLASH_WORDS; idx++) {
+        if(data[idx] != committed[idx])
+            changed++;
+    }
+
+    status.seq = odometer_seq_next(status.seq);
+
+    if(flash_offset + (changed + 1) * sizeof(flash_entry_t) > flash->sector_size) {
+        flash_compact(odometers, NULL);
+        return;
+    }
+
+    for(idx = 0; changed && idx < FLASH_WORDS; idx++) {
+        if(data[idx] != committed[idx]) {
+            entry.index = idx;
+            entry.value = committed[idx] = data[idx];
+            entry.crc = flash_entry_crc(&entry);
+            status.writes++;
+            if(!flash->program(sector_address(flash_sector) + flash_offset, &entry, sizeof(flash_entry_t))) {
+                flash_offset = flash->sector_size; // Compact on the next write as the log now ends with uncommitted entries.
+                return;
+            }
+            flash_offset += sizeof(flash_entry_t);
+            changed--;
+        }
+    }
+
+    entry.index = FLASH_ENTRY_COMMIT;
+    entry.value = status.seq;
+    entry.crc = flash_entry_crc(&entry);
+    status.writes++;
+    if(flash->program(sector_address(flash_sector) + flash_offset, &entry, sizeof(flash_entry_t)))
+        flash_offset += sizeof(flash_entry_t);
+    else
+        flash_offset = flash->sector_size;
+}
+
+static bool flash_commit (void)
+{
+    return true;
+}
+
+// Load data from the valid sector with the newest generation and replay the log.
+// Entries not followed by a commit entry, e.g. from a write torn by a power loss, are discarded.
+// The log is compacted if it ends with such entries as entries appended later would otherwise be replayed on top of them.
+static bool flash_load (odometer_data_t *odometers)
+{
+    bool ok = false, uncommitted = false;
+    flash_header_t header[2];
+    flash_entry_t entry;
+    uint_fast8_t sector;
+    uint32_t base;
+
+    for(sector = 0; sector < 2; sector++) {
+        if(!flash->read(&header[sector], sector_address(sector), sizeof(flash_header_t)))
+            header[sector].magic = 0;
+    }
+
+    sector = header[1].magic == FLASH_MAGIC && (header[0].magic != FLASH_MAGIC || (int32_t)(header[1].generation - header[0].generation) > 0);
+
+    do {
+        if(header[sector].magic == FLASH_MAGIC) {
+            base = sector_address(sector);
+            if((ok = flash_record_read(base + sizeof(flash_header_t), odometers, &status.seq))) {
+                status.slot = flash_sector = sector;
+                flash_generation = header[sector].generation;
+            } else
+                header[sector].magic = 0;
+        }
+        sector ^= 1;
+    } while(!ok && header[sector].magic == FLASH_MAGIC);
+
+    if(ok) {
+
+        memcpy(&record.data, odometers, sizeof(odometer_data_t));
+
+        // Entries are applied to the record image and copied to the odometer data when a commit entry is found.
+        base = sector_address(flash_sector);
+        flash_offset = FLASH_LOG_OFFSET;
+
+        while(flash_offset + sizeof(flash_entry_t) <= flash->sector_size && flash->read(&entry, base + flash_offset, sizeof(flash_entry_t))) {
+
+            if(entry.index == FLASH_ENTRY_ERASED && entry.crc == 0xFFFF && entry.value == 0xFFFFFFFF)
+                break;
+
+            flash_offset += sizeof(flash_entry_t); // Skip entry even if corrupt, it cannot be programmed again.
+
+            if(entry.crc != flash_entry_crc(&entry)) {
+                // Discard the entries of the torn commit and continue with the entries written after it.
+                uncommitted = true;
+                memcpy(&record.data, odometers, sizeof(odometer_data_t));
+            } else if(entry.index == FLASH_ENTRY_COMMIT) {
+                uncommitted = false;
+                status.seq = entry.value;
+                memcpy(odometers, &record.data, sizeof(odometer_data_t));
+            } else if(entry.index < FLASH_WORDS) {
+                uncommitted = true;
+                ((uint32_t *)&record.data)[entry.index] = entry.value;
+            }
+        }
+
+        memcpy(&record.data, odometers, sizeof(odometer_data_t));
+
+        if(uncommitted)
+            flash_compact(odometers, NULL);
+    }
+
+    return ok;
+}
+
+// Read data of the record located by flash_open() with the committed log entries applied,
+// entries are applied as by flash_load() to a copy of the range read.
+static bool flash_read (void *data, uint32_t offset, uint32_t size)
+{
+    uint8_t pending[ODOMETER_CRC_CHUNK], *committed = data;
+    uint32_t address, end;
+    uint_fast8_t byte;
+    flash_entry_t entry;
+
+    if(size > sizeof(pending))
+        return flash_read(data, offset, sizeof(pending)) && flash_read(committed + sizeof(pending), offset + sizeof(pending), size - sizeof(pending));
+
+    if(!flash->read(data, opened.address + offset, size))
+        return false;
+
+    memcpy(pending, data, size);
+    end = offset + size;
+
+    for(address = opened.log; address && address + sizeof(flash_entry_t) <= opened.log_end && flash->read(&entry, address, sizeof(flash_entry_t)); address += sizeof(flash_entry_t)) {
+
+        if(entry.index == FLASH_ENTRY_ERASED && entry.crc == 0xFFFF && entry.value == 0xFFFFFFFF)
+            break;
+
+        if(entry.crc != flash_entry_crc(&entry))
+            memcpy(pending, data, size);
+        else if(entry.index == FLASH_ENTRY_COMMIT)
+            memcpy(data, pending, size);
+        else for(byte = 0; byte < sizeof(uint32_t); byte++) {
+            if(entry.index * sizeof(uint32_t) + byte >= offset && entry.index * sizeof(uint32_t) + byte < end)
+                pending[entry.index * sizeof(uint32_t) + byte - offset] = ((uint8_t *)&entry.value)[byte];
+        }
+    }
+
+    return true;
+}
+
+static bool flash_record_open (uint32_t offset, odometer_record_header_t *header)
+{
+    opened.address = offset + sizeof(odometer_record_header_t);
+
+    return flash->read(header, offset, sizeof(odometer_record_header_t)) && header->size < flash->sector_size / 2 &&
+            odometer_record_check(header, flash_read);
+}
+
+// Locate the data in the valid sector with the newest generation with any layout.
+static bool flash_open (bool previous, odometer_record_header_t *header)
+{
+    bool ok = false;
+    flash_header_t sector_header[2];
+    uint_fast8_t sector;
+    uint32_t base;
+
+    opened.log = 0;
+
+    for(sector = 0; sector < 2; sector++) {
+        if(!flash->read(&sector_header[sector], sector_address(sector), sizeof(flash_header_t)))
+            sector_header[sector].magic = 0;
+    }
+
+    sector = sector_header[1].magic == FLASH_MAGIC && (sector_header[0].magic != FLASH_MAGIC || (int32_t)(sector_header[1].generation - sector_header[0].generation) > 0);
+
+    do {
+        if(sector_header[sector].magic == FLASH_MAGIC) {
+            base = sector_address(sector) + sizeof(flash_header_t);
+            if(!(ok = flash_record_open(base, header) &&
+                       (!previous || flash_record_open(base + FLASH_RECORD_ALIGN(sizeof(odometer_record_header_t) + header->size), header))))
+                sector_header[sector].magic = 0;
+        }
+    } while(!ok && sector_header[sector ^= 1].magic == FLASH_MAGIC);
+
+    // The log follows the current and previous records, both are stored with the same layout.
+    // The sector is made the active sector so that the data imported is written to the other sector.
+    if(ok && !previous) {
+        status.seq = header->seq;
+        status.slot = flash_sector = sector;
+        flash_generation = sector_header[sector].generation;
+        opened.log = base + FLASH_RECORD_ALIGN(sizeof(odometer_record_header_t) + header->size) * 2;
+        opened.log_end = base - sizeof(flash_header_t) + flash->sector_size;
+    }
+
+    return ok;
+}
+
+static bool flash_reset (odometer_data_t *current, odometer_data_t *previous)
+{
+    status.seq = odometer_seq_next(status.seq);
+
+    return flash_compact(current, previous);
+}
+
+// Returns NULL if the sector size is too small to hold the records and a log entry for each word of the data.
+const odometer_storage_t *odometer_flash_init (const odometer_flash_t *flash_io)
+{
+    static const odometer_storage_t storage = {
+        .name = "FLASH",
+        .cap.delta = On,
+        .status = &status,
+        .load = flash_load,
+        .load_previous = flash_load_previous,
+        .write = flash_write,
+        .commit = flash_commit,
+        .reset = flash_reset,
+        .open = flash_open,
+        .read = flash_read
+    };
+
+    if(flash_io->sector_size < FLASH_LOG_OFFSET + sizeof(flash_entry_t) * (FLASH_WORDS + 1))
+        return NULL;
+
+    flash = flash_io;
+
+    return &storage;
+}
+
+#endif
@@ -0,0 +1,513 @@
+/*
+
+  odometer_journal.c - odometer data journal for EEPROM and FRAM
+
+  Part of grblHAL
+
+  Copyright (c) 2026 agent
+
+  Grbl is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Grbl is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Grbl.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifdef ARDUINO
+#include "../driver.h"
+#else
+#include "driver.h"
+#endif
+
+#if ODOMETER_ENABLE
+
+#include <string.h>
+#include <stddef.h>
+
+#include "odometer_storage.h"
+
+#ifndef ODOMETER_JOURNAL_SLOTS
+#define ODOMETER_JOURNAL_SLOTS 4    // Number of NVS slots odometer data writes are rotated over, minimum 2.
+#endif
+
+#if ODOMETER_JOURNAL_SLOTS < 2
+#error "ODOMETER_JOURNAL_SLOTS must be 2 or larger!"
+#endif
+
+#ifndef ODOMETER_NVS_PAGE_SIZE
+#define ODOMETER_NVS_PAGE_SIZE 16   // bytes, EEPROM writes are split in chunks not crossing page boundaries of this size.
+#endif
+
+#define JOURNAL_SLOT_SIZE sizeof(odometer_record_t)
+#define JOURNAL_MAGIC 0x4F4A        // "JO"
+#define JOURNAL_PREVIOUS 0x01       // Geometry flag, the previous log is stored.
+#define JOURNAL_FLUSH 0x02          // Geometry flag, a flush slot is reserved.
+
+// The journal is a ring of slots holding sequence numbered records, the previous log is stored in a separate record.
+// Each commit is written to the slot following the current one, the current slot is only advanced when the write
+// has completed so the last good data is never overwritten.
+// With ODOMETER_POWER_FAIL enabled a separate flush slot follows the ring, it is written by flush() only and
+// is included when searching for the newest record on startup.
+// The journal is placed at the top of the NVS space given, from the top: the geometry, the previous log, the flush slot
+// and the ring.
+// When the record layout or geometry is changed the records stored are located from the geometry stored for import.
+// The converted data is then written and verified in a ring slot clear of the imported records before the geometry
+// and the previous log are written, until then the imported records are kept and imported again on startup.
+
+#if ODOMETER_POWER_FAIL
+#define JOURNAL_FLUSH_SLOTS 1
+#else
+#define JOURNAL_FLUSH_SLOTS 0
+#endif
+
+typedef struct {
+    uint16_t crc;                   // CRC of the following fields.
+    uint16_t slot_size;
+    uint8_t slots;                  // Number of ring slots.
+    uint8_t flags;
+    uint16_t magic;
+} journal_geometry_t;
+
+static nvs_io_t nvs;
+static uint32_t journal_address, previous_address, geometry_address;
+static uint32_t open_address;      // Address of the record located by journal_open().
+static uint32_t imported_address;  // Address of the newest record of the stored geometry located by journal_open().
+static bool imported = false;
+static journal_geometry_t geometry, stored; // Geometry in use and as stored, stored.magic is cleared if none is stored.
+static bool geometry_stored = false;
+static uint_fast8_t journal_slot = 0;
+static odometer_record_t record;    // Image of the slot being written.
+static odometer_crc_cache_t record_crc = {0};
+static odometer_storage_status_t status = {0};
+static struct {
+    bool busy;
+    bool pending;                   // Commit requested while busy.
+    uint_fast8_t slot;
+    uint_fast16_t offset;           // Offset of the next chunk in the record, the header is written when all data has been written.
+    odometer_data_t *data;
+} writer = {0};
+#if ODOMETER_POWER_FAIL
+static volatile bool image_ready = false;
+static odometer_record_t image;     // Sealed copy of the data for flush().
+static odometer_crc_cache_t image_crc = {0};
+#endif
+
+static inline uint16_t geometry_crc (journal_geometry_t *geometry)
+{
+    return odometer_crc16(0xFFFF, &geometry->slot_size, sizeof(journal_geometry_t) - sizeof(uint16_t));
+}
+
+// Stored when data is first written with the current geometry.
+static bool geometry_write (void)
+{
+    if(!geometry_stored) {
+        geometry.crc = geometry_crc(&geometry);
+        status.writes++;
+        geometry_stored = nvs.memcpy_to_nvs(geometry_address, (uint8_t *)&geometry, sizeof(journal_geometry_t), false) == NVS_TransferResult_OK;
+    }
+
+    return geometry_stored;
+}
+
+static inline uint32_t slot_address (uint_fast8_t slot)
+{
+    return journal_address + slot * JOURNAL_SLOT_SIZE;
+}
+
+static bool record_read (uint32_t address, odometer_data_t *data, uint32_t *seq)
+{
+    odometer_record_header_t header;
+
+    bool ok = nvs.memcpy_from_nvs((uint8_t *)&header, address, sizeof(odometer_record_header_t), false) == NVS_TransferResult_OK &&
+               nvs.memcpy_from_nvs((uint8_t *)data, address + sizeof(odometer_record_header_t), sizeof(odometer_data_t), false) == NVS_TransferResult_OK &&
+                odometer_record_valid(&header, data);
+
+    if(ok && seq)
+        *seq = header.seq;
+
+    return ok;
+}
+
+// Synchronous write, data first and header last.
+static bool record_write (uint32_t address, odometer_data_t *data, uint32_t seq)
+{
+    odometer_record_header_t header;
+
+    odometer_record_seal(&header, data, seq);
+    status.writes += 2;
+
+    return nvs.memcpy_to_nvs(address + sizeof(odometer_record_header_t), (uint8_t *)data, sizeof(odometer_data_t), false) == NVS_TransferResult_OK &&
+            nvs.memcpy_to_nvs(address, (uint8_t *)&header, sizeof(odometer_record_header_t), false) == NVS_TransferResult_OK;
+}
+
+// Take a snapshot of the odometer data and start writing it to the slot following the current one.
+static void writer_start (void)
+{
+    status.seq = odometer_seq_next(status.seq);
+
+    odometer_record_update(&record, writer.data, status.seq, &record_crc);
+
+    writer.slot = journal_slot + 1 == status.slots ? 0 : journal_slot + 1;
+    writer.offset = sizeof(odometer_record_header_t);
+    writer.pending = false;
+    writer.busy = true;
+}
+
+// Writes the next chunk of the record.
+// The data is written in chunks not crossing EEPROM page boundaries and the header last,
+// a slot with an incomplete write then fails the CRC check and is ignored on startup.
+// For EEPROM each chunk is compared with the slot content first and only the range of bytes
+// that differs is written, chunks that are unchanged are skipped without writing.
+// At most one chunk is read and written per call so a pass of the foreground process is not held up.
+static bool journal_commit (void)
+{
+    bool ok;
+    uint8_t *data, current[ODOMETER_NVS_PAGE_SIZE];
+    uint32_t address;
+    uint_fast16_t size, start, end;
+
+    if(!writer.busy)
+        return true;
+
+    if(writer.offset < sizeof(odometer_record_t)) {
+
+        address = slot_address(writer.slot) + writer.offset;
+        data = (uint8_t *)&record + writer.offset;
+        size = sizeof(odometer_record_t) - writer.offset;
+
+        if(nvs.type == NVS_FRAM) {
+            ok = nvs.memcpy_to_nvs(address, data, size, false) == NVS_TransferResult_OK;
+            status.writes++;
+        } else {
+
+            if(size > ODOMETER_NVS_PAGE_SIZE - address % ODOMETER_NVS_PAGE_SIZE)
+                size = ODOMETER_NVS_PAGE_SIZE - address % ODOMETER_NVS_PAGE_SIZE;
+
+            if((ok = nvs.memcpy_from_nvs(current, address, size, false) == NVS_TransferResult_OK)) {
+
+                for(start = 0; start < size && current[start] == data[start]; start++);
+                for(end = size; end > start && current[end - 1] == data[end - 1]; end--);
+
+                if(start < end) {
+                    ok = nvs.memcpy_to_nvs(address + start, data + start, end - start, false) == NVS_TransferResult_OK;
+                    status.writes++;
+                }
+            }
+        }
+
+        writer.offset += size;
+    } else {
+        status.writes++;
+        if((ok = nvs.memcpy_to_nvs(slot_address(writer.slot), (uint8_t *)&record.header, sizeof(odometer_record_header_t), false) == NVS_TransferResult_OK))
+            status.slot = journal_slot = writer.slot;
+        writer.busy = false;
+    }
+
+    if(!ok)
+        writer.busy = false;
+
+    if(!writer.busy && writer.pending)
+        writer_start();
+
+    status.pending = writer.busy ? sizeof(odometer_record_t) - writer.offset + sizeof(odometer_record_header_t) : 0;
+
+    return !writer.busy;
+}
+
+// Start writing a snapshot of the data in the background, if a write is in progress
+// a new snapshot is written when it has completed.
+static void journal_write (odometer_data_t *data)
+{
+    writer.data = data;
+
+    if(writer.busy)
+        writer.pending = true;
+    else
+        writer_start();
+
+    status.pending = sizeof(odometer_record_t);
+}
+
+static uint32_t slot_seq (uint_fast8_t slot)
+{
+    uint32_t seq;
+
+    if(nvs.memcpy_from_nvs((uint8_t *)&seq, slot_address(slot) + offsetof(odometer_record_header_t, seq), sizeof(uint32_t), false) != NVS_TransferResult_OK)
+        seq = ODOMETER_SEQ_EMPTY;
+
+    return seq;
+}
+
+// Load the valid slot with the newest sequence number.
+// Slots are written in ring order with increasing sequence numbers, starting with slot 1 on a new journal.
+// From the first slot written the sequence numbers increase up to the newest slot and then drops to older
+// or not yet written slots, the newest slot is found by a binary search reading log2(slots) sequence numbers.
+// A slot with an interrupted write keeps the sequence number of its previous content since the header
+// is written last. Only the newest slot is read in full for CRC validation, if it is corrupt the
+// preceding slots are tried in reverse ring order.
+static bool journal_load (odometer_data_t *data)
+{
+    bool ok = false;
+    uint32_t seq, first;
+    uint_fast8_t low = 0, high = status.slots - 1, mid, tries = status.slots;
+
+    // Data is imported from the records of the stored geometry until a record has been written with the new geometry.
+    if(stored.magic == JOURNAL_MAGIC && !geometry_stored)
+        return false;
+
+    if((first = slot_seq(low)) == ODOMETER_SEQ_EMPTY)
+        first = slot_seq(++low);
+
+    if(first == ODOMETER_SEQ_EMPTY)
+        low = high; // Not a journal written from slot 1, fall back to trying all slots.
+    else while(low < high) {
+        mid = (low + high + 1) >> 1;
+        if((seq = slot_seq(mid)) != ODOMETER_SEQ_EMPTY && (int32_t)(seq - first) >= 0)
+            low = mid;
+        else
+            high = mid - 1;
+    }
+
+    do {
+        if((ok = record_read(slot_address(low), data, &status.seq)))
+            status.slot = journal_slot = low;
+        else
+            low = low == 0 ? status.slots - 1 : low - 1;
+    } while(!ok && --tries);
+
+    if(ok)
+        geometry_write();
+
+#if ODOMETER_POWER_FAIL
+    // Use the flush slot if newer, the ring continues from the newest ring slot.
+    if((seq = slot_seq(status.slots)) != ODOMETER_SEQ_EMPTY && (!ok || (int32_t)(seq - status.seq) > 0)) {
+        image_crc.valid = false; // Image is used as buffer.
+        if(record_read(slot_address(status.slots), ok ? &image.data : data, &status.seq)) {
+            if(ok)
+                memcpy(data, &image.data, sizeof(odometer_data_t));
+            status.slot = status.slots;
+            ok = true;
+        }
+    }
+#endif
+
+    return ok;
+}
+
+static bool journal_load_previous (odometer_data_t *data)
+{
+    return (geometry.flags & JOURNAL_PREVIOUS) && record_read(previous_address, data, NULL);
+}
+
+static inline uint32_t journal_size (uint32_t slot_size, uint_fast8_t slots, uint_fast8_t flags)
+{
+    return (slots + ((flags & JOURNAL_FLUSH) ? 1 : 0) + ((flags & JOURNAL_PREVIOUS) ? 1 : 0)) * slot_size + sizeof(journal_geometry_t);
+}
+
+static bool journal_read (void *data, uint32_t offset, uint32_t size)
+{
+    return nvs.memcpy_from_nvs((uint8_t *)data, open_address + sizeof(odometer_record_header_t) + offset, size, false) == NVS_TransferResult_OK;
+}
+
+static bool journal_record_open (uint32_t address, uint32_t slot_size, odometer_record_header_t *header)
+{
+    open_address = address;
+
+    return nvs.memcpy_from_nvs((uint8_t *)header, address, sizeof(odometer_record_header_t), false) == NVS_TransferResult_OK &&
+            header->size <= slot_size - sizeof(odometer_record_header_t) && odometer_record_check(header, journal_read);
+}
+
+// Locate the newest valid record, or the previous log, with any layout by the geometry stored.
+// All slots are checked as this is only used when the layout has been changed.
+static bool journal_open (bool previous, odometer_record_header_t *header)
+{
+    bool ok = false;
+    uint_fast8_t slot, slots;
+    uint32_t address, newest = 0;
+    odometer_record_header_t candidate;
+
+    if(stored.magic != JOURNAL_MAGIC)
+        return false;
+
+    if(previous)
+        return (stored.flags & JOURNAL_PREVIOUS) && journal_record_open(geometry_address - stored.slot_size, stored.slot_size, header);
+
+    address = geometry_address + sizeof(journal_geometry_t) - journal_size(stored.slot_size, stored.slots, stored.flags);
+    slots = stored.slots + ((stored.flags & JOURNAL_FLUSH) ? 1 : 0);
+
+    for(slot = 0; slot < slots; slot++, address += stored.slot_size) {
+        if(journal_record_open(address, stored.slot_size, &candidate) && (!ok || (int32_t)(candidate.seq - header->seq) > 0)) {
+            memcpy(header, &candidate, sizeof(odometer_record_header_t));
+            newest = address;
+            ok = true;
+        }
+    }
+
+    if(ok) {
+        open_address = imported_address = newest;
+        imported = true;
+        status.seq = header->seq;
+    }
+
+    return ok;
+}
+
+static inline bool overlaps (uint32_t address, uint32_t size, uint32_t other, uint32_t other_size)
+{
+    return address < other + other_size && other < address + size;
+}
+
+// Checks that a slot is clear of the imported record and, if requested, the stored previous log.
+static bool slot_clear (uint_fast8_t slot, bool previous)
+{
+    return stored.magic != JOURNAL_MAGIC ||
+            ((!imported || !overlaps(slot_address(slot), JOURNAL_SLOT_SIZE, imported_address, stored.slot_size)) &&
+              (!previous || !(stored.flags & JOURNAL_PREVIOUS) || !overlaps(slot_address(slot), JOURNAL_SLOT_SIZE, geometry_address - stored.slot_size, stored.slot_size)));
+}
+
+// Write the current data to the lowest slot clear of the imported records, and read it back for validation,
+// before the geometry and the previous log are written. Without a geometry stored slot 0 is used, v0.06 data is kept
+// at the top of NVS and the lowest slot is below it as a slot is larger than the v0.06 data.
+// If there is no slot clear of both imported records the previous log is given up before the current data.
+static bool journal_create (odometer_data_t *current, odometer_data_t *previous)
+{
+    bool ok;
+    uint_fast8_t slot;
+    uint32_t seq = odometer_seq_next(status.seq);
+    odometer_record_header_t header;
+
+    for(slot = 0; slot < status.slots && !slot_clear(slot, true); slot++);
+
+    if(slot == status.slots)
+        for(slot = 0; slot < status.slots && !slot_clear(slot, false); slot++);
+
+    if(slot == status.slots)
+        slot = 0;
+
+    if((ok = record_write(slot_address(slot), current, seq) && journal_record_open(slot_address(slot), JOURNAL_SLOT_SIZE, &header) &&
+              header.size == sizeof(odometer_data_t) && header.seq == seq)) {
+        status.seq = seq;
+        status.slot = journal_slot = slot;
+        imported = false;
+        ok = geometry_write() && (previous == NULL || !(geometry.flags & JOURNAL_PREVIOUS) || record_write(previous_address, previous, 0));
+    }
+
+    status.pending = 0;
+
+    return ok;
+}
+
+static bool journal_reset (odometer_data_t *current, odometer_data_t *previous)
+{
+    bool ok;
+
+    if(!geometry_stored)
+        return journal_create(current, previous);
+
+    ok = previous == NULL || !(geometry.flags & JOURNAL_PREVIOUS) || record_write(previous_address, previous, 0);
+
+    journal_write(current);
+
+    return ok;
+}
+
+#if ODOMETER_POWER_FAIL
+
+// The image is sealed with the sequence number following the last commit started,
+// it is prepared again by the core after each commit.
+static void journal_prepare (odometer_data_t *data)
+{
+    image_ready = false;
+    odometer_record_update(&image, data, odometer_seq_next(status.seq), &image_crc);
+    image_ready = true;
+}
+
+// Called from the power fail interrupt, FRAM is recommended as the full record is written at once.
+static bool journal_flush (void)
+{
+    bool ok;
+
+    if((ok = image_ready)) {
+        image_ready = false;
+        ok = nvs.memcpy_to_nvs(slot_address(status.slots), (uint8_t *)&image, sizeof(odometer_record_t), false) == NVS_TransferResult_OK;
+    }
+
+    return ok;
+}
+
+#endif
+
+// Use the top of the size bytes of NVS starting at address for ODOMETER_JOURNAL_SLOTS slots, the flush slot
+// if enabled and the previous log. If these does not fit the number of slots is reduced, down to two,
+// and then the previous log is dropped. When this differs from the stored geometry, e.g. the number of slots is changed
+// or more space is given, the journal is rebuilt and the data imported from the records of the stored geometry.
+// Returns NULL if there is not enough space for two slots and the flush slot, if enabled.
+const odometer_storage_t *odometer_journal_init (nvs_io_t *nvs_io, uint32_t address, uint32_t size)
+{
+    static odometer_storage_t storage = {
+        .name = "JOURNAL",
+        .cap.background = On,
+        .cap.rotating = On,
+        .status = &status,
+        .load = journal_load,
+        .load_previous = journal_load_previous,
+        .write = journal_write,
+        .commit = journal_commit,
+        .reset = journal_reset,
+#if ODOMETER_POWER_FAIL
+        .prepare = journal_prepare,
+        .flush = journal_flush,
+#endif
+        .open = journal_open,
+        .read = journal_read
+    };
+
+    if(size < journal_size(JOURNAL_SLOT_SIZE, 2, JOURNAL_FLUSH_SLOTS ? JOURNAL_FLUSH : 0))
+        return NULL;
+
+    memcpy(&nvs, nvs_io, sizeof(nvs_io_t));
+    memset(&status, 0, sizeof(odometer_storage_status_t));
+    memset(&writer, 0, sizeof(writer));
+    record_crc.valid = false;
+    journal_slot = 0;
+    imported = false;
+
+    storage.cap.delta = nvs.type != NVS_FRAM;
+
+    geometry_address = address + size - sizeof(journal_geometry_t);
+
+    if(!(nvs.memcpy_from_nvs((uint8_t *)&stored, geometry_address, sizeof(journal_geometry_t), false) == NVS_TransferResult_OK &&
+          stored.magic == JOURNAL_MAGIC && stored.crc == geometry_crc(&stored) &&
+           stored.slots >= 2 && stored.slot_size > sizeof(odometer_record_header_t) &&
+            journal_size(stored.slot_size, stored.slots, stored.flags) <= geometry_address + sizeof(journal_geometry_t)))
+        stored.magic = 0;
+
+    geometry.magic = JOURNAL_MAGIC;
+    geometry.slot_size = JOURNAL_SLOT_SIZE;
+    geometry.slots = ODOMETER_JOURNAL_SLOTS;
+    geometry.flags = JOURNAL_PREVIOUS | (JOURNAL_FLUSH_SLOTS ? JOURNAL_FLUSH : 0);
+    while(geometry.slots > 2 && journal_size(JOURNAL_SLOT_SIZE, geometry.slots, geometry.flags) > size)
+        geometry.slots--;
+    if(journal_size(JOURNAL_SLOT_SIZE, geometry.slots, geometry.flags) > size)
+        geometry.flags &= ~JOURNAL_PREVIOUS;
+
+    geometry_stored = stored.magic == JOURNAL_MAGIC && stored.slot_size == geometry.slot_size &&
+                       stored.slots == geometry.slots && stored.flags == geometry.flags;
+
+    previous_address = geometry_address - JOURNAL_SLOT_SIZE;
+    status.slots = geometry.slots;
+    journal_address = geometry_address + sizeof(journal_geometry_t) - journal_size(JOURNAL_SLOT_SIZE, geometry.slots, geometry.flags);
+    status.address = journal_address;
+
+    return &storage;
+}
+
+#endif
@@ -0,0 +1,200 @@
+/*
+
+  odometer_storage.h - odometer data persistence, internal interface
+
+  Part of grblHAL
+
+  Copyright (c) 2026 agent
+
+  Grbl is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Grbl is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Grbl.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef _ODOMETER_STORAGE_H_
+#define _ODOMETER_STORAGE_H_
+
+#ifdef ARDUINO
+#include "../grbl/nvs_buffer.h"
+#else
+#include "grbl/nvs_buffer.h"
+#endif
+
+#include "odometer.h"
+
+#ifndef ODOMETER_SCALE_HISTORY
+#define ODOMETER_SCALE_HISTORY 1    // Number of steps/mm settings kept per axis, 1 to convert the step count on changes.
+#endif
+
+#if ODOMETER_SCALE_HISTORY < 1
+#error "ODOMETER_SCALE_HISTORY must be 1 or larger!"
+#endif
+
+#ifndef ODOMETER_SPINDLES
+#define ODOMETER_SPINDLES 2         // Number of spindles run time and starts are logged for, assigned on first use. Max 8.
+#endif
+
+#if ODOMETER_SPINDLES < 1 || ODOMETER_SPINDLES > 8
+#error "ODOMETER_SPINDLES must be in the range 1 - 8!"
+#endif
+
+#ifndef ODOMETER_RPM_BINS
+#define ODOMETER_RPM_BINS 0         // Number of bins in the run time per rpm histogram of each spindle, 0 to disable.
+#endif
+
+#if ODOMETER_RPM_BINS < 0 || ODOMETER_RPM_BINS > 255
+#error "ODOMETER_RPM_BINS must be in the range 0 - 255!"
+#endif
+
+#ifndef ODOMETER_SPINDLE_ENCODER
+#define ODOMETER_SPINDLE_ENCODER 0  // Set to 1 to log measured revolutions and speed deviation of spindles with an encoder.
+#endif
+
+#ifndef ODOMETER_POWER_FAIL
+#define ODOMETER_POWER_FAIL 0       // Set to 1 to keep a sealed image of the data ready for odometer_power_fail().
+#endif
+
+#define ODOMETER_SEQ_EMPTY 0xFFFFFFFF
+#define ODOMETER_DATA_VERSION 2     // Increment when the layout of odometer_data_t is changed and add the layout to odometer_layout().
+#define ODOMETER_SPINDLE_FREE 0xFF  // Log entry not assigned to a spindle.
+#define ODOMETER_BLOCK_ENCODER 0x01 // Optional block flag, the encoder log is stored.
+#define ODOMETER_BLOCKS (ODOMETER_SPINDLE_ENCODER ? ODOMETER_BLOCK_ENCODER : 0)
+
+typedef struct {
+    uint32_t time;                  // s
+    uint32_t starts;
+    uint32_t revolutions;           // Commanded, in thousands.
+    uint32_t load;                  // s, run time weighted by commanded rpm relative to max rpm.
+} odometer_spindle_t;
+
+// Measured by the spindle encoder, logged with ODOMETER_SPINDLE_ENCODER enabled.
+typedef struct {
+    uint32_t revolutions;           // Thousands.
+    uint16_t deviation_mean;        // Per mille, mean deviation of measured from commanded rpm in the last run sampled.
+    uint16_t deviation_max;         // Per mille, max deviation in the last run sampled.
+} odometer_encoder_t;
+
+#if ODOMETER_RPM_BINS
+
+// Bins are scaled by a common power of two, when a bin overflows the scale is increased and all bins halved.
+typedef struct {
+    uint16_t scale;                 // Bins are in units of 2^scale s.
+    uint16_t bin_rpm;               // Bin width, set from the spindle max rpm on first use. The last bin includes higher rpm.
+    uint16_t bins[ODOMETER_RPM_BINS];
+} odometer_histogram_t;
+
+#endif
+
+// Step counts are 48 bit, split in a low and high part to avoid padding.
+// Entry 0 is for the current steps/mm setting, entries for older settings follows.
+// The first fields records the version and the configuration the size of the data depends on,
+// data stored with another layout is imported field by field.
+// The encoder log and the histograms are only stored when enabled, the scale history only when kept.
+typedef struct {
+    uint8_t version;                // ODOMETER_DATA_VERSION
+    uint8_t axes;                   // N_AXIS
+    uint8_t history;                // ODOMETER_SCALE_HISTORY
+    uint8_t spindles;               // ODOMETER_SPINDLES
+    uint8_t bins;                   // ODOMETER_RPM_BINS, 0 if no histograms are stored.
+    uint8_t blocks;                 // ODOMETER_BLOCKS
+    uint8_t reserved[2];
+    uint32_t motors;                // s
+    uint32_t spindle;               // s, sum of all spindles including spindles without a log entry.
+    uint8_t spindle_id[ODOMETER_SPINDLES]; // Spindle id per log entry or ODOMETER_SPINDLE_FREE.
+    odometer_spindle_t spindle_log[ODOMETER_SPINDLES]; // Indexed by log entry.
+#if ODOMETER_SPINDLE_ENCODER
+    odometer_encoder_t encoder_log[ODOMETER_SPINDLES]; // Indexed by log entry.
+#endif
+    float steps_per_mm[N_AXIS][ODOMETER_SCALE_HISTORY];
+    uint32_t steps[N_AXIS][ODOMETER_SCALE_HISTORY];
+    uint16_t steps_hi[N_AXIS][ODOMETER_SCALE_HISTORY];
+#if ODOMETER_RPM_BINS
+    odometer_histogram_t rpm_histogram[ODOMETER_SPINDLES]; // Indexed by log entry.
+#endif
+} odometer_data_t;
+
+typedef struct {
+    uint16_t crc;                   // CRC of the data chunk CRCs and the following fields, written last.
+    uint16_t size;                  // Size of data.
+    uint32_t seq;                   // Incremented on each write, the valid record with the highest number is the current data.
+} odometer_record_header_t;
+
+typedef struct {
+    odometer_record_header_t header;
+    odometer_data_t data;
+} odometer_record_t;
+
+#ifndef ODOMETER_CRC_CHUNK
+#define ODOMETER_CRC_CHUNK 32       // bytes, granularity of incremental CRC updates.
+#endif
+
+#define ODOMETER_CRC_CHUNKS ((sizeof(odometer_data_t) + ODOMETER_CRC_CHUNK - 1) / ODOMETER_CRC_CHUNK)
+#define ODOMETER_CRC_CHUNK_SIZE(offset) (sizeof(odometer_data_t) - (offset) < ODOMETER_CRC_CHUNK ? sizeof(odometer_data_t) - (offset) : ODOMETER_CRC_CHUNK)
+
+typedef struct {
+    bool valid;
+    uint16_t crc[ODOMETER_CRC_CHUNKS]; // CRC of each chunk of the data.
+} odometer_crc_cache_t;
+
+// Reads size bytes at offset in the data of the record located by open().
+typedef bool (*odometer_read_ptr)(void *data, uint32_t offset, uint32_t size);
+
+typedef union {
+    uint8_t value;
+    struct {
+        uint8_t background :1,      // Writes are completed by calls to commit().
+                rotating   :1,      // Writes are rotated over status.slots slots, each byte is written at most once per commit.
+                delta      :1,      // Only changed data is written.
+                unused     :5;
+    };
+} odometer_storage_cap_t;
+
+typedef struct {
+    uint32_t writes;                // Number of writes issued since startup.
+    uint32_t seq;                   // Sequence number of the last commit.
+    uint32_t pending;               // Number of bytes left to write of the commit in progress.
+    uint_fast8_t slots;             // Number of slots writes are rotated over.
+    uint_fast8_t slot;              // Slot or sector holding the current data.
+    uint32_t address;               // Lowest NVS address used, for NVS based storage.
+} odometer_storage_status_t;
+
+typedef struct {
+    const char *name;
+    odometer_storage_cap_t cap;
+    odometer_storage_status_t *status;
+    bool (*load)(odometer_data_t *data);                                // Read the newest valid record.
+    bool (*load_previous)(odometer_data_t *data);                       // Read the previous log.
+    void (*write)(odometer_data_t *data);                               // Write a record, data is referenced until the write is completed.
+    bool (*commit)(void);                                               // Continue write in progress, returns true when completed.
+    bool (*reset)(odometer_data_t *current, odometer_data_t *previous); // Write the previous log, if not NULL, and the current data.
+    void (*prepare)(odometer_data_t *data);                             // Optional, seal a copy of the data for flush().
+    bool (*flush)(void);                                                // Optional, write the prepared copy in a single write, interrupt safe.
+    bool (*open)(bool previous, odometer_record_header_t *header);      // Optional, locate the newest valid record or the previous log with any layout.
+    odometer_read_ptr read;                                             // Read from the data of the record located by open().
+} odometer_storage_t;
+
+uint16_t odometer_crc16 (uint16_t crc, const void *data, uint32_t size);
+void odometer_record_seal (odometer_record_header_t *header, const odometer_data_t *data, uint32_t seq);
+void odometer_record_update (odometer_record_t *record, const odometer_data_t *data, uint32_t seq, odometer_crc_cache_t *cache);
+bool odometer_record_valid (const odometer_record_header_t *header, const odometer_data_t *data);
+bool odometer_record_check (const odometer_record_header_t *header, odometer_read_ptr read);
+uint32_t odometer_seq_next (uint32_t seq);
+
+const odometer_storage_t *odometer_journal_init (nvs_io_t *nvs, uint32_t address, uint32_t size);
+const odometer_storage_t *odometer_flash_init (const odometer_flash_t *flash);
+
+#ifdef ODOMETER_FILE
+nvs_io_t *odometer_file_open (const char *path, uint32_t size);
+#endif
+
+#endif